@@ -0,0 +1,52 @@
+#!/bin/sh
+# Check of the 64-bit sizing: a synthetic P5 image over 2^32 pixels is copied with the "-" kernel
+# streamed, partitioned and with the MPI programs, and every result must match the source byte for byte.
+# Needs twice the image size (8.6 GB by default) of free disk in $DIR.
+#   ./check_large_image.sh [<width> <height>]
+# The height must be a multiple of the partitions (and of partitions * chunks for the MPI programs),
+# the rows left over by the division are not convolved.
+# Binaries, MPI launcher, partitions and chunks can be changed through the variables below. MPIIO=1 also runs the
+# MPI programs with CONV_MPIIO=1, which keeps the band of every rank in memory (several times the image in total).
+SERIAL=${SERIAL:-./serialconv}
+MPI=${MPI:-./mpiconv}
+HYBRID=${HYBRID:-./hybridconv}
+MPIRUN=${MPIRUN:-"mpirun -n 3"}
+PARTITIONS=${PARTITIONS:-64}
+CHUNKS=${CHUNKS:-4}
+DIR=${DIR:-.}
+WIDTH=${1:-65537}
+HEIGHT=${2:-65536}
+SOURCE=$DIR/large_source.pgm
+RESULT=$DIR/large_result.pgm
+PIXELS=$((WIDTH * HEIGHT))
+status=0
+
+# Pixels repeat every 251 bytes (a prime, so consecutive rows start at different bytes): a row or a
+# band written in the wrong place does not match
+printf "P5\n# check_large_image.sh\n%d %d\n255\n" "$WIDTH" "$HEIGHT" > "$SOURCE"
+yes "$(awk 'BEGIN { for (i = 1; i <= 250; i++) printf "%c", 33 + (i * 37) % 94 }')" | head -c "$PIXELS" >> "$SOURCE"
+echo "Source: $WIDTH x $HEIGHT = $PIXELS pixels"
+
+# Compare the pixels after the headers, the result header may be written differently
+check() {
+    if [ -f "$RESULT" ] && [ "$(head -c 2 "$RESULT")" = "P5" ] &&
+       [ $(($(wc -c < "$RESULT") - PIXELS)) -gt 0 ] &&
+       cmp -s "$RESULT" "$SOURCE" $(($(wc -c < "$RESULT") - PIXELS)) $(($(wc -c < "$SOURCE") - PIXELS)); then
+        echo "OK   $1"
+    else
+        echo "FAIL $1"
+        status=1
+    fi
+    rm -f "$RESULT"
+}
+
+$SERIAL "$SOURCE" - "$RESULT" > /dev/null; check "streamed"
+$SERIAL "$SOURCE" - "$RESULT" "$PARTITIONS" > /dev/null; check "$PARTITIONS partitions"
+$MPIRUN $MPI "$SOURCE" - "$RESULT" "$PARTITIONS" "$CHUNKS" > /dev/null; check "MPI, $PARTITIONS partitions, $CHUNKS chunks"
+if [ -n "$MPIIO" ]; then
+    CONV_MPIIO=1 $MPIRUN $MPI "$SOURCE" - "$RESULT" "$PARTITIONS" "$CHUNKS" > /dev/null; check "MPI-IO"
+fi
+$MPIRUN $HYBRID "$SOURCE" - "$RESULT" "$PARTITIONS" "$CHUNKS" > /dev/null; check "hybrid, $PARTITIONS partitions, $CHUNKS chunks"
+
+rm -f "$SOURCE"
+exit $status
@@ -38,3 +38,10 @@
 ./serialconv /share/apps/files/convolution/images/im06.ppm /share/apps/files/convolution/kernel/kernel99x99_random.txt ./prova.ppm 1
 ./serialconv /share/apps/files/convolution/images/im07.ppm /share/apps/files/convolution/kernel/kernel99x99_random.txt ./prova.ppm 1
 ./serialconv /share/apps/files/convolution/images/im10.ppm /share/apps/files/convolution/kernel/kernel99x99_random.txt ./prova.ppm 1
+
+# Speedup of the SIMD convolution kernels (tconv, 4th field of the output) against the scalar ones, by kernel size
+for k in kernel3x3_Edge kernel5x5_Sharpen kernel25x25_random kernel49x49_random kernel99x99_random; do
+    scalar=$(CONV_FFT=0 CONV_SIMD=scalar ./serialconv /share/apps/files/convolution/images/im01.ppm /share/apps/files/convolution/kernel/$k.txt ./prova.ppm 1 | tail -1 | cut -d, -f4)
+    simd=$(CONV_FFT=0 ./serialconv /share/apps/files/convolution/images/im01.ppm /share/apps/files/convolution/kernel/$k.txt ./prova.ppm 1 | tail -1 | cut -d, -f4)
+    echo "$k $scalar $simd" | awk '{printf "%s: %.6f s scalar, %.6f s SIMD, speedup %.2f\n", $1, $2, $3, $2 / $3}'
+done
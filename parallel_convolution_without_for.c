@@ -7,17 +7,91 @@
 // This program calculates the convolution for PPM images.
 // The program accepts an PPM image file, a text definition of the kernel matrix and the PPM file for storing the convolution results.
 // The program allows to define image partitions for processing large images (>500MB)
-// The 2D image is represented by 1D vector for chanel R, G and B. The convolution is applied to each chanel separately.
+// The 2D image is represented by 1D vector for chanel R, G and B (only one for PGM). The convolution is applied to each chanel separately.
 
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
 #include <time.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#define HAVE_URING 1
+#endif
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 #include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_FFTW
+#include <fftw3.h>
+#endif
 #include <omp.h>
 
+// io_uring submission/completion queues and the registered buffers used with them (CONV_URING=1).
+struct uringqueue{
+    int fd;
+    unsigned entries, pending;
+    unsigned *sqtail, *sqmask, *sqarray, *cqhead, *cqtail, *cqmask;
+    void *sqring, *cqring, *sqes, *cqes;
+    size_t sqringsize, cqringsize, sqessize;
+    char **bufs;
+    int nbufs;
+    long transferred;
+    // Requests in flight, by slot (user_data)
+    int *op, *opfd;
+    char **opbuf;
+    size_t *oplen;
+    long *opoff;
+};
+typedef struct uringqueue* UringQueue;
+
+// Tiled planar image (*.pct): a header, the tile offset table and, for every tile, the R, G and B planes (R for PGM) of
+// (tilew+2*pad) x (tileh+2*pad) samples. The pad repeats the pixels around the tile (zero outside the image),
+// so a region with a halo up to pad rows only needs the tiles under the region itself.
+struct tileinfo{
+    int tilew, tileh, pad, bytes;   // tile size, padding and bytes of a sample (1 or 2, host byte order)
+    int tilesx, tilesy;
+    long tablepos, tilesize;   // offset of the tile offset table and bytes of one tile
+    uint64_t *offsets;
+    // Writing: window of the tile row being filled, with pad rows above and below it
+    void *R, *G, *B;   // samples of bytes each, like the image planes
+    int first;   // first image row of the tile row
+    long stored;   // pixels stored so far
+};
+typedef struct tileinfo* TileInfo;
+
+// Compressed image stream (gzip with -DHAVE_ZLIB -lz, zstd with -DHAVE_ZSTD -lzstd). A compressed source is
+// inflated by a thread into a pipe; a compressed result is written as independent blocks, one per thread.
+struct codecstream{
+    int type;   // CODEC_GZIP or CODEC_ZSTD
+    int reading;
+    FILE *file;   // compressed source, owned by the thread
+    int fd;   // write end of the pipe
+    pthread_t thread;
+    unsigned char prefix[4];   // magic number bytes already taken from the source
+    int nprefix;
+};
+typedef struct codecstream* CodecStream;
+
 // Structure to store image.
 struct imagenppm{
     int altura;
@@ -25,64 +99,306 @@ struct imagenppm{
     char *comentario;
     int maxcolor;
     int P;
-    int *R;
-    int *G;
-    int *B;
+    int channels;   // 3 planes (R, G, B) for PPM, 1 (R) for PGM (P2, P5)
+    int bytes;   // bytes of a sample: 1 (uint8_t planes) when maxcolor <= 255, else 2 (uint16_t planes)
+    void *R;
+    void *G;   // NULL for PGM
+    void *B;
+    long datapos;   // Offset of the first pixel in the source file
+    int pipe;   // Source can not seek (stdin or a FIFO): it is only read forward
+    unsigned char *carry;   // P3 bytes of a pipe read past the last chunk
+    long carrylen;
+    unsigned char *map;   // Source file mapping (CONV_MMAP=1), NULL when read with stdio
+    size_t mapsize;
+    long *rowindex;   // Offset of every indexstep-th row (CONV_INDEX=<rows>), NULL without index
+    int indexstep;
+    UringQueue uring;   // Asynchronous reads or writes (CONV_URING=1), NULL with stdio
+    TileInfo tiles;   // Tile layout of a tiled (*.pct) image, NULL for PPM
+    CodecStream codec;   // Compressed source or result, NULL when not compressed
 };
 typedef struct imagenppm* ImagenData;
 
+// Samples of the planes, by their size in bytes (1 or 2). The convolution widens them to int and stores them back
+// saturated to [0, maxcolor].
+#define SAMPLE_BYTES(maxcolor) (((maxcolor) > 255) ? 2 : 1)
+#define GETSAMPLE(p, bytes, i) (((bytes) == 1) ? (int)((uint8_t *)(p))[i] : (int)((uint16_t *)(p))[i])
+#define PUTSAMPLE(p, bytes, i, v) do { if ((bytes) == 1) ((uint8_t *)(p))[i] = (uint8_t)(v); \
+                                       else ((uint16_t *)(p))[i] = (uint16_t)(v); } while (0)
+#define SAMPLEAT(p, bytes, i) ((void *)((char *)(p) + (long)(i) * (bytes)))
+#define CLAMPSAMPLE(v, maxcolor) (((v) < 0) ? 0 : ((v) > (maxcolor)) ? (maxcolor) : (v))
+
+// Size of the buffer used for the binary (P6) reads.
+#define PPM_IOBUFFER 65536
+// Size of the ASCII (P3) read buffer and zeroed tail after the data.
+#define PPM_READBUFFER (8 << 20)
+#define PPM_READPAD 16
+// Smallest slice of a P3 window given to one parsing thread.
+#define PPM_MINSLICE (64 << 10)
+// Row index sidecar: header of magic, image size and mtime, width, height and rows per entry.
+#define PPM_INDEXMAGIC 0x3158444950504cL
+#define PPM_INDEXHEADER 6
+// Smallest band of output rows of the streaming mode.
+#define STREAM_BANDROWS 64
+// Depth of the io_uring queues and size of every request.
+#define URING_DEPTH 32
+#define URING_BLOCK (1 << 20)
+// Size of the per-thread write buffer and longest text of one pixel ("%d %d %d ").
+#define PPM_WRITEBUFFER (4 << 20)
+#define PPM_MAXPIXEL 36
+// Tiled images: magic number, unsigned ints of the header and default tile size (CONV_TILE=<size>[,<pad>]).
+#define TILE_MAGIC "PCT1"
+#define TILE_HEADER 9
+#define TILE_SIZE 256
+// Compressed images: kinds and size of the decompressing thread buffers.
+#define CODEC_GZIP 1
+#define CODEC_ZSTD 2
+#define CODEC_BLOCK (1 << 20)
+
+// Pixels of a row convolved together in the interior of a plane (convolveInterior).
+#define CONV_BLOCK 256
+// Output rows widened to int and convolved at a time by convolvePlanes (at least 8 kernel heights).
+#define CONV_BANDROWS 256
+// Relative tolerance of the separable kernel detection.
+#define KERNEL_SEPTOL 1e-5
+// Operations per point and level of the FFT against one multiply-add of convolve2D (cost model of fftWorth).
+#define FFT_COST 16
+// Smallest side of the overlap-save FFT tiles.
+#define FFT_TILE 64
+// Round half up and drop the fraction bits of a fixed-point sum (convolveFixed).
+#define FIXEDROUND(sum, shift) (((sum) + (1 << (shift) >> 1)) >> (shift))
+
 // Structure to store the kernel.
 struct structkernel{
     int kernelX;
     int kernelY;
     float *vkern;
+    int separable;   // vkern is the outer product col x row (see separateKernel)
+    float *row, *col;
+    double *spec;    // kernel spectrum for an fftX x fftY transform (see kernelSpectrum)
+    int16_t *qkern;  // fixed-point weights vkern * 2^qshift (CONV_FIXED=1, see quantizeKernel), or NULL
+    int32_t *qpair;  // weights n and n+1 of a kernel row (0 past its end) in the low and high halves, for pmaddwd
+    int qshift;
+    int specX, specY;
 };
 typedef struct structkernel* kernelData;
 
+// Convolution of the interior samples from..to-1 of a row of channels interleaved samples per pixel
+// (convolveInterior and its SIMD versions).
+typedef void (*InteriorKernel)(int* in, int* out, int sizeX, int channels, float* kernel, int ksizeX, int ksizeY, int row,
+                               int from, int to);
+// Same for the versions unrolled for one kernel size, which is built in.
+typedef void (*UnrolledKernel)(int* in, int* out, int sizeX, int channels, float* kernel, int row, int from, int to);
+// Same for the fixed-point weights of convolveFixed, over the sample pairs of widenFixed.
+typedef void (*FixedKernel)(int32_t* in, int* out, int sizeX, int channels, kernelData kern, int row, int from, int to);
+
+// Overlap-save tiles of the FFT convolution: fftX x fftY transforms giving tileX x tileY output pixels each,
+// with the twiddle factors (or the FFTW plans) shared by the threads and the length of their work buffers.
+struct fftblock{
+    int fftX, fftY, tileX, tileY;
+    long worklen;
+#ifdef HAVE_FFTW
+    fftw_plan forward, inverse;
+#else
+    double *twX, *twY;
+#endif
+};
+typedef struct fftblock* FFTBlock;
+
 //Functions Definition
 ImagenData initimage(char* nombre, FILE **fp, int partitions, int halo);
 ImagenData duplicateImageData(ImagenData src, int partitions, int halo);
 
-int readImage(ImagenData Img, FILE **fp, int dim, int halosize, long int *position);
-int duplicateImageChunk(ImagenData src, ImagenData dst, int dim);
+int readImage(ImagenData Img, FILE **fp, long dim, int halosize, long int *position);
+int duplicateImageChunk(ImagenData src, ImagenData dst, long dim);
 int initfilestore(ImagenData img, FILE **fp, char* nombre, long *position);
-int savingChunk(ImagenData img, FILE **fp, int dim, int offset);
-int convolve2D(int* inbuf, int* outbuf, int sizeX, int sizeY, float* kernel, int ksizeX, int ksizeY);
+int savingChunk(ImagenData img, FILE **fp, long dim, long offset);
+int readImageP6(ImagenData img, FILE **fp, long dim, int halosize, long *position);
+int parseInteger(const unsigned char *s, int *value);
+void unpackPixels(ImagenData img, const unsigned char *data, long from, long n);
+long parseTokens(const unsigned char *buffer, long from, long to, void **planes, int bytes, int channels, long got,
+                 long total, long halotoken, long *halopos, long *end);
+int pwriteAll(int fd, const char *buffer, size_t len, off_t offset);
+size_t formatPixels(ImagenData img, char *buffer, long from, long to);
+int formatInteger(char *s, int value);
+int mapImage(ImagenData img, FILE *fp);
+void mapWillNeed(ImagenData img, long offset, long len);
+int loadRowIndex(ImagenData img, char *nombre, FILE *fp, int step);
+int buildRowIndex(ImagenData img, FILE *fp);
+long pixelPosition(ImagenData img, FILE *fp, long pixel);
+int tiledOpen(ImagenData img, FILE *fp);
+int tiledCreate(ImagenData img, FILE *fp, int tilesize, int pad);
+int tiledName(char *nombre);
+int readTiles(ImagenData img, FILE **fp, long dim, int halosize, long *position);
+int saveTiles(ImagenData img, FILE **fp, long dim, long offset);
+int storeTileRow(ImagenData img, FILE *fp);
+void tiledDestroy(TileInfo t);
+int codecOpen(ImagenData img, FILE **fp);
+int codecName(char *nombre);
+void *decompressStream(void *arg);
+size_t codecBound(int type, size_t len);
+size_t compressBlock(int type, const char *data, size_t len, char *out, size_t outlen);
+void codecClose(CodecStream s);
+UringQueue uringCreate(unsigned entries, int nbufs, size_t buflen);
+void uringDestroy(UringQueue q);
+int uringQueue(UringQueue q, int write, int fd, int buf, char *data, size_t len, long off);
+int uringWait(UringQueue q);
+long uringRead(UringQueue q, int fd, int buf, char *data, size_t len, long off);
+int convolve2D(int* inbuf, int* outbuf, int sizeX, int sizeY, int channels, float* kernel, int ksizeX, int ksizeY);
+void convolveClipped(int* inbuf, int* outbuf, int sizeX, int sizeY, int channels, float* kernel, int ksizeX,
+                     int ksizeY, int row, int from, int to);
+void convolveInterior(int* inbuf, int* outbuf, int sizeX, int channels, float* kernel, int ksizeX, int ksizeY,
+                      int row, int from, int to);
+void convolveInteriorAVX2(int* inbuf, int* outbuf, int sizeX, int channels, float* kernel, int ksizeX, int ksizeY,
+                          int row, int from, int to);
+void convolveInteriorAVX512(int* inbuf, int* outbuf, int sizeX, int channels, float* kernel, int ksizeX,
+                            int ksizeY, int row, int from, int to);
+void convolveInterior3x3(int* inbuf, int* outbuf, int sizeX, int channels, float* kernel,
+                         int row, int from, int to);
+void convolveInterior5x5(int* inbuf, int* outbuf, int sizeX, int channels, float* kernel,
+                         int row, int from, int to);
+void convolveInterior7x7(int* inbuf, int* outbuf, int sizeX, int channels, float* kernel,
+                         int row, int from, int to);
+void convolveInterior3x3AVX2(int* inbuf, int* outbuf, int sizeX, int channels, float* kernel,
+                             int row, int from, int to);
+void convolveInterior3x3AVX512(int* inbuf, int* outbuf, int sizeX, int channels, float* kernel,
+                               int row, int from, int to);
+void convolveInterior5x5AVX512(int* inbuf, int* outbuf, int sizeX, int channels, float* kernel,
+                               int row, int from, int to);
+void convolveInterior7x7AVX512(int* inbuf, int* outbuf, int sizeX, int channels, float* kernel,
+                               int row, int from, int to);
+int simdLevel(void);
+InteriorKernel interiorKernel(void);
+UnrolledKernel unrolledKernel(int ksizeX, int ksizeY);
+int convolveFixed(void* inbuf, int* outbuf, int sizeX, int sizeY, int channels, kernelData kern, int rowFrom,
+                  int rowTo);
+void convolveFixedClipped(void* inbuf, int paired, int* outbuf, int sizeX, int sizeY, int channels,
+                          kernelData kern, int row, int from, int to);
+void convolveInteriorFixed(int16_t* inbuf, int* outbuf, int sizeX, int channels, kernelData kern,
+                           int row, int from, int to);
+void convolveInteriorFixedPairs(int32_t* inbuf, int* outbuf, int sizeX, int channels, kernelData kern,
+                                int row, int from, int to);
+void convolveInteriorFixedAVX2(int32_t* inbuf, int* outbuf, int sizeX, int channels, kernelData kern,
+                               int row, int from, int to);
+void convolveInteriorFixedAVX512(int32_t* inbuf, int* outbuf, int sizeX, int channels, kernelData kern,
+                                 int row, int from, int to);
+FixedKernel fixedKernel(void);
+int convolvePlanes(void** inbuf, void** outbuf, int channels, int sizeX, int sizeY, int bytes, int maxcolor,
+                   kernelData kern);
+int convolveBand(int* inbuf, int* outbuf, int sizeX, int sizeY, kernelData kern);
+void widenSamples(void** planes, int channels, int bytes, long first, long n, int* dst);
+void widenFixed(void** planes, int channels, long first, long n, int paired, void* dst);
+void storeSamples(int* src, void** planes, int channels, int bytes, int maxcolor, long first, long n);
+int convolveSeparable(int* inbuf, int* outbuf, int sizeX, int sizeY, kernelData kern);
+void separateKernel(kernelData kern);
+void quantizeKernel(kernelData kern);
+int convolveFFT(int* inbuf, int* outbuf, int sizeX, int sizeY, kernelData kern);
+int fftWorth(kernelData kern, int sizeX, int sizeY);
+int fftLength(int n);
+int fftTileLength(int size, int ksize);
+double *fftAlloc(long n);
+void fftRelease(double *p);
+double *fftTwiddles(int n);
+void fft1D(double *z, int n, double *tw, int inverse);
+int fftBlockInit(FFTBlock fb, kernelData kern, int sizeX, int sizeY);
+void fftBlockFree(FFTBlock fb);
+void fftRows(FFTBlock fb, double *spec, double *z, int *plane, float *kplane, int sizeX, int sizeY, int x0, int y0);
+void fftColumns(FFTBlock fb, double *spec, double *kspec, double *z);
+void fftRowsInverse(FFTBlock fb, double *spec, double *z, int *out, int sizeX, int sizeY, int x0, int y0,
+                    int offX, int offY);
+void fftTile(FFTBlock fb, double *spec, double *work, int *in, int *out, int sizeX, int sizeY, kernelData kern,
+             int x0, int y0);
+int kernelSpectrum(kernelData kern, FFTBlock fb);
 void freeImagestructure(ImagenData *src);
+int streamBandRows(kernelData kern);
+int streamImage(ImagenData source, ImagenData output, FILE *fpsrc, FILE *fpdst, kernelData kern, int bufrows,
+                long position, double *tread, double *tconv, double *tstore);
+void partitionLayout(int c, int partitions, long partsize, int ancho, int halo, int *halosize, long *chunksize, long *offset);
+int pipelinePartitions(ImagenData source, ImagenData output, FILE *fpsrc, FILE *fpdst, kernelData kern, int partitions,
+                       int halo, long position, double *tread, double *tcopy, double *tconv, double *tstore);
 
 //Open Image file and image struct initialization
 ImagenData initimage(char* nombre, FILE **fp,int partitions, int halo){
     char c;
     char comentario[300];
-    int i=0,chunk=0;
+    char magic[4];
+    int i=0;
+    long chunk=0;
     ImagenData img=NULL;
     
     /*Opening ppm*/
 
-    if ((*fp=fopen(nombre,"r"))==NULL){
+    //"-" reads the image from stdin
+    if ((*fp = (strcmp(nombre, "-") == 0) ? stdin : fopen(nombre,"r"))==NULL){
         perror("Error: ");
     }
     else{
         //Memory allocation
         img=(ImagenData) malloc(sizeof(struct imagenppm));
 
-        //Reading the first line: Magical Number "P3"
-        fscanf(*fp,"%c%d ",&c,&(img->P));
-        
-        //Reading the image comment
-        while((c=fgetc(*fp))!= '\n'){comentario[i]=c;i++;}
-        comentario[i]='\0';
-        //Allocating information for the image comment
-        img->comentario = calloc(strlen(comentario),sizeof(char));
-        strcpy(img->comentario,comentario);
-        //Reading image dimensions and color resolution
-        fscanf(*fp,"%d %d %d",&img->ancho,&img->altura,&img->maxcolor);
-        chunk = img->ancho*img->altura / partitions;
+        //Compressed images are decompressed by a thread into a pipe
+        if (codecOpen(img, fp)) return NULL;
+        img->tiles = NULL;
+        //Tiled images have their own binary header. The second byte tells them apart, so a pipe never goes back.
+        if ((c = fgetc(*fp)) == TILE_MAGIC[0] && (c = fgetc(*fp)) == TILE_MAGIC[1]) {
+            if (fread(magic, 1, 2, *fp) != 2 || memcmp(magic, TILE_MAGIC + 2, 2) || tiledOpen(img, *fp)) {
+                fprintf(stderr, "Error: bad tiled image header in %s\n", nombre);
+                return NULL;
+            }
+        }
+        else {
+            ungetc(c, *fp);
+            //Reading the first line: Magical Number "P3"
+            fscanf(*fp,"%d ",&(img->P));
+            img->channels = (img->P == 2 || img->P == 5) ? 1 : 3;
+
+            //Reading the image comment
+            while((c=fgetc(*fp))!= '\n'){comentario[i]=c;i++;}
+            comentario[i]='\0';
+            //Allocating information for the image comment
+            img->comentario = calloc(strlen(comentario)+1,sizeof(char));
+            strcpy(img->comentario,comentario);
+            //Reading image dimensions and color resolution
+            fscanf(*fp,"%d %d %d",&img->ancho,&img->altura,&img->maxcolor);
+            //A single whitespace separates the header from the pixels (binary data starts just after it in P6).
+            fgetc(*fp);
+            img->datapos = ftell(*fp);
+        }
+        //Pipes are read forward only, keeping the P3 bytes that follow every chunk
+        img->pipe = lseek(fileno(*fp), 0, SEEK_CUR) < 0;
+        img->carry = NULL;
+        img->carrylen = 0;
+        if (img->pipe) {
+            img->datapos = 0;
+            if (img->tiles != NULL) {
+                fprintf(stderr, "Error: tiled images can not be read from a pipe\n");
+                return NULL;
+            }
+            if (img->P != 6 && img->P != 5 && (img->carry = malloc(PPM_READBUFFER + PPM_READPAD)) == NULL) return NULL;
+        }
+        img->map = NULL;
+        img->mapsize = 0;
+        if (!img->pipe && getenv("CONV_MMAP") != NULL && atoi(getenv("CONV_MMAP")) && mapImage(img, *fp))
+            fprintf(stderr, "Warning: can not map %s, reading it with stdio\n", nombre);
+        img->rowindex = NULL;
+        img->indexstep = 0;
+        if (img->P != 6 && img->P != 5 && img->tiles == NULL && !img->pipe && getenv("CONV_INDEX") != NULL && atoi(getenv("CONV_INDEX")) > 0 &&
+            loadRowIndex(img, nombre, *fp, atoi(getenv("CONV_INDEX"))))
+            fprintf(stderr, "Warning: can not index %s, reading it sequentially\n", nombre);
+        img->uring = NULL;
+        if (img->map == NULL && img->tiles == NULL && !img->pipe && getenv("CONV_URING") != NULL && atoi(getenv("CONV_URING")) &&
+            (img->uring = uringCreate(URING_DEPTH, 1, PPM_READBUFFER + PPM_READPAD)) == NULL)
+            fprintf(stderr, "Warning: io_uring is not available, reading %s with stdio\n", nombre);
+        //Streaming (partitions == 0) only keeps a window of halo rows.
+        chunk = (partitions > 0) ? (long)img->ancho*img->altura / partitions : 0;
         //We need to read an extra row.
-        chunk = chunk + img->ancho * halo;
-        if ((img->R=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
-        if ((img->G=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
-        if ((img->B=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
+        chunk = chunk + (long)img->ancho * halo;
+        //Samples take one byte up to maxcolor 255, two above
+        img->bytes = SAMPLE_BYTES(img->maxcolor);
+        img->G = img->B = NULL;
+        if ((img->R=calloc(chunk,img->bytes)) == NULL) {return NULL;}
+        //PGM images only have one plane
+        if (img->channels == 3 && (img->G=calloc(chunk,img->bytes)) == NULL) {return NULL;}
+        if (img->channels == 3 && (img->B=calloc(chunk,img->bytes)) == NULL) {return NULL;}
     }
     return img;
 }
@@ -92,61 +408,982 @@ ImagenData duplicateImageData(ImagenData src, int partitions, int halo){
     char c;
     char comentario[300];
     unsigned int imageX, imageY;
-    int i=0, chunk=0;
+    int i=0;
+    long chunk=0;
     //Struct memory allocation
     ImagenData dst=(ImagenData) malloc(sizeof(struct imagenppm));
 
     //Copying the magic number
     dst->P=src->P;
+    dst->channels=src->channels;
     //Copying the string comment
-    dst->comentario = calloc(strlen(src->comentario),sizeof(char));
+    dst->comentario = calloc(strlen(src->comentario)+1,sizeof(char));
     strcpy(dst->comentario,src->comentario);
     //Copying image dimensions and color resolution
     dst->ancho=src->ancho;
     dst->altura=src->altura;
     dst->maxcolor=src->maxcolor;
-    chunk = dst->ancho*dst->altura / partitions;
+    dst->bytes=src->bytes;
+    dst->datapos=src->datapos;
+    dst->pipe=0;
+    dst->carry=NULL;
+    dst->carrylen=0;
+    dst->map=NULL;
+    dst->mapsize=0;
+    dst->rowindex=NULL;
+    dst->indexstep=0;
+    dst->uring=NULL;
+    dst->tiles=NULL;
+    dst->codec=NULL;
+    chunk = (partitions > 0) ? (long)dst->ancho*dst->altura / partitions : 0;
     //We need to read an extra row.
-    chunk = chunk + src->ancho * halo;
-    if ((dst->R=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
-    if ((dst->G=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
-    if ((dst->B=calloc(chunk,sizeof(int))) == NULL) {return NULL;}
+    chunk = chunk + (long)src->ancho * halo;
+    dst->G = dst->B = NULL;
+    if ((dst->R=calloc(chunk,dst->bytes)) == NULL) {return NULL;}
+    if (dst->channels == 3 && (dst->G=calloc(chunk,dst->bytes)) == NULL) {return NULL;}
+    if (dst->channels == 3 && (dst->B=calloc(chunk,dst->bytes)) == NULL) {return NULL;}
     return dst;
 }
 
 //Read the corresponding chunk from the source Image
-int readImage(ImagenData img, FILE **fp, int dim, int halosize, long *position){
-    int i=0, k=0,haloposition=0;
-    if (fseek(*fp,*position,SEEK_SET))
+int readImage(ImagenData img, FILE **fp, long dim, int halosize, long *position){
+    if (img->tiles != NULL) return readTiles(img, fp, dim, halosize, position);
+    if (img->P == 6 || img->P == 5) return readImageP6(img, fp, dim, halosize, position);
+
+    unsigned char *buffer;
+    long base=0, len=0, p=0, e=0, n=0;   // file offset of buffer[0], bytes in the buffer, cursor, end of window
+    long first = *position, got=0, total=(long)img->channels*dim, halotoken=-1, halopos=-1, end=-1;
+    long pertoken = 2, want = 0, v = 0;   // expected bytes of a number and its separator
+    int eof=0;
+    void *planes[3];
+    planes[0] = img->R; planes[1] = img->G; planes[2] = img->B;
+    if (img->map != NULL) {
+        // The whole file is in memory: parse in place, the buffer never needs a refill
+        buffer = img->map;
+        len = img->mapsize;
+        p = *position;
+        eof = 1;
+    }
+    else if (img->carry != NULL) {
+        // A pipe can not seek: the bytes read after the previous chunk start the buffer
+        buffer = img->carry;
+        len = img->carrylen;
+        base = *position;
+    }
+    else {
+        if (fseek(*fp,*position,SEEK_SET))
+            perror("Error: ");
+        if (img->uring != NULL) buffer = (unsigned char *)img->uring->bufs[0];
+        else if ((buffer = malloc(PPM_READBUFFER + PPM_READPAD)) == NULL) return -1;
+        base = *position;
+    }
+    for (v = img->maxcolor; v > 0; v /= 10) pertoken++;
+    // When start reading the halo store the position in the image file
+    if (halosize != 0) halotoken = (long)img->channels * (dim-((long)img->ancho*halosize*2));
+    while (got < total) {
+        if (img->map == NULL && !eof) {
+            memmove(buffer, buffer + p, len - p);
+            base += p; len -= p; p = 0;
+            // Read about what the rest of the chunk needs, small chunks do not pull a whole buffer
+            want = (total - got) * pertoken + PPM_MINSLICE;
+            if (want > PPM_READBUFFER - len) want = PPM_READBUFFER - len;
+            if (img->uring != NULL)
+                n = uringRead(img->uring, fileno(*fp), 0, (char *)buffer + len, want, base + len);
+            else n = fread(buffer + len, 1, want, *fp);
+            if (n <= 0) eof = 1;
+            else len += n;
+            memset(buffer + len, 0, PPM_READPAD);
+        }
+        // Parse a window that ends on a separator, so no number is cut in two
+        e = (img->map != NULL && p + PPM_READBUFFER < len) ? p + PPM_READBUFFER : len;
+        if (e < len || !eof)
+            while (e > p && buffer[e-1] > ' ') e--;
+        if (e <= p && (eof || img->map != NULL)) e = len;
+        n = parseTokens(buffer, p, e, planes, img->bytes, img->channels, got, total, halotoken, &halopos, &end);
+        if (n < 0 || (n == 0 && eof && e == len)) {
+            fprintf(stderr, "Error: bad or truncated P%d image data at pixel %ld\n", img->P, (got + (n > 0 ? n : 0)) / img->channels);
+            if (img->map == NULL && img->uring == NULL && img->carry == NULL) free(buffer);
+            return -1;
+        }
+        if (halopos >= 0) { *position = base + halopos; halopos = -1; halotoken = -1; }
+        got += n;
+        p = (got == total) ? end : e;
+    }
+    // Without halo the next read starts just after this chunk
+    if (halosize == 0) *position = base + p;
+    if (img->map != NULL) {
+        // Ask for the next partition, assumed to be as long as this one
+        mapWillNeed(img, p, p - first);
+    }
+    else if (img->carry != NULL) {
+        memmove(buffer, buffer + p, len - p);
+        img->carrylen = len - p;
+    }
+    else if (img->uring == NULL) free(buffer);
+    return 0;
+}
+
+// Parse the numbers of buffer[from, to) into the planes of bytes samples, as tokens got .. total-1 of the chunk
+// (token k is sample k%channels of pixel k/channels). The window is split in one slice per thread at separators; every thread counts
+// the numbers of its slice, a prefix sum gives each slice its first token and then all slices are parsed
+// at the same time. Stores the offset of token halotoken in *halopos and the offset after token total-1 in
+// *end when they are in the window. Returns the number of tokens stored, or -1 on bad data.
+long parseTokens(const unsigned char *buffer, long from, long to, void **planes, int bytes, int channels, long got,
+                 long total, long halotoken, long *halopos, long *end){
+    long *counts;
+    long stored=0;
+    int nthreads=1, error=0;
+#ifdef _OPENMP
+    // Small windows are not worth a parallel region
+    if (to - from > PPM_MINSLICE) nthreads = omp_get_max_threads();
+    if (nthreads > (to - from) / PPM_MINSLICE + 1) nthreads = (int)((to - from) / PPM_MINSLICE) + 1;
+#endif
+    if ((counts = calloc(nthreads + 1, sizeof(long))) == NULL) return -1;
+#pragma omp parallel num_threads(nthreads) reduction(+:stored) reduction(|:error)
+    {
+        int t = 0, threads = 1;
+        long s, e, i, k, cnt = 0, g;
+        int n, value;
+#ifdef _OPENMP
+        t = omp_get_thread_num();
+        threads = omp_get_num_threads();
+#endif
+        // Slice limits, moved forward past the number they fall into
+        s = from + (to - from) * t / threads;
+        e = from + (to - from) * (t + 1) / threads;
+        if (t > 0) while (s < to && buffer[s-1] > ' ' && buffer[s] > ' ') s++;
+        if (t < threads - 1) while (e < to && buffer[e-1] > ' ' && buffer[e] > ' ') e++;
+        else e = to;
+        // Phase 1: count the numbers of the slice
+        for (i = s; i < e; i++)
+            cnt += (buffer[i] > ' ') & (i == s || buffer[i-1] <= ' ');
+        counts[t+1] = cnt;
+#pragma omp barrier
+#pragma omp single
+        for (k = 1; k <= threads; k++) counts[k] += counts[k-1];
+        // Phase 2: parse the slice from its first token index
+        g = got + counts[t];
+        for (i = s; i < e && g < total; g++) {
+            while (i < e && buffer[i] <= ' ') i++;
+            if (i >= e) break;
+            if (g == halotoken) *halopos = i;
+            n = parseInteger(buffer + i, &value);
+            if (n == 0 || (i + n < e && buffer[i+n] > ' ')) { error = 1; break; }
+            PUTSAMPLE(planes[g % channels], bytes, g / channels, value);
+            i += n;
+            stored++;
+            if (g == total - 1) *end = i;
+        }
+    }
+    free(counts);
+    return error ? -1 : stored;
+}
+
+// Split n binary (P6 or P5) pixels of data into the planes of img, from pixel from. 16-bit samples are big-endian
+// in the file and host order in the planes.
+void unpackPixels(ImagenData img, const unsigned char *data, long from, long n){
+    long j=0, i=from;
+    uint8_t *r8 = img->R, *g8 = img->G, *b8 = img->B;
+    uint16_t *r16 = img->R, *g16 = img->G, *b16 = img->B;
+    if (img->channels == 1) {
+        if (img->bytes == 1) memcpy(r8 + from, data, n);
+        else
+            for (j=0;j<n;j++,i++)
+                r16[i] = (uint16_t)((data[2*j] << 8) | data[2*j+1]);
+        return;
+    }
+    if (img->bytes == 1) {
+        for (j=0;j<n;j++,i++) {
+            r8[i] = data[3*j];
+            g8[i] = data[3*j+1];
+            b8[i] = data[3*j+2];
+        }
+    }
+    else {
+        for (j=0;j<n;j++,i++) {
+            r16[i] = (uint16_t)((data[6*j]   << 8) | data[6*j+1]);
+            g16[i] = (uint16_t)((data[6*j+2] << 8) | data[6*j+3]);
+            b16[i] = (uint16_t)((data[6*j+4] << 8) | data[6*j+5]);
+        }
+    }
+}
+
+// Decode the (optionally negative) decimal integer at s. Returns the number of bytes used, 0 if there is no number.
+// The buffer must be readable 8 bytes past the number. On little-endian GCC targets 8 digits are
+// classified and converted at once with SWAR arithmetic on a 64-bit word.
+int parseInteger(const unsigned char *s, int *value){
+    int k=0, neg=0;
+    long v=0;
+    if (s[0] == '-') { neg = 1; k = 1; }
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t w, nd, x;
+    int digits;
+    memcpy(&w, s + k, 8);
+    // Non-zero bytes of nd are the bytes that are not in '0'..'9'
+    nd = ((w & 0xF0F0F0F0F0F0F0F0ULL) ^ 0x3030303030303030ULL) |
+         (((w + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) ^ 0x3030303030303030ULL);
+    digits = nd ? __builtin_ctzll(nd) >> 3 : 8;
+    if (digits > 0) {
+        x = (w & 0x0F0F0F0F0F0F0F0FULL) << (8 * (8 - digits));
+        x = (x * 2561) >> 8;
+        x = ((x & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+        x = ((x & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+        v = (long)x;
+        k += digits;
+        if (digits < 8) {
+            *value = neg ? -(int)v : (int)v;
+            return k;
+        }
+    }
+    else if (!(s[k] >= '0' && s[k] <= '9')) return 0;
+#else
+    if (!(s[k] >= '0' && s[k] <= '9')) return 0;
+#endif
+    while (s[k] >= '0' && s[k] <= '9') { v = v * 10 + (s[k] - '0'); k++; }
+    *value = neg ? -(int)v : (int)v;
+    return k;
+}
+
+//Read the corresponding chunk from a binary (P6 or P5) source Image. Samples are 1 byte, or 2 bytes big-endian when maxcolor > 255.
+int readImageP6(ImagenData img, FILE **fp, long dim, int halosize, long *position){
+    unsigned char buffer[PPM_IOBUFFER];
+    int bytes = (img->maxcolor > 255) ? 2 : 1;
+    int pixel = img->channels * bytes;
+    unsigned char *data = buffer;
+    long start = *position;
+    long i=0, n=0, haloposition=0;
+    haloposition = dim-((long)img->ancho*halosize*2);
+    // Pixels have a fixed size, so the halo position is known without reading
+    *position = *position + haloposition * pixel;
+    if (img->map != NULL) {
+        if ((size_t)start + (size_t)dim * pixel > img->mapsize) {
+            fprintf(stderr, "Error: unexpected end of P6 image data\n");
+            return -1;
+        }
+        mapWillNeed(img, start + (long)dim * pixel, (long)dim * pixel);
+    }
+    else if (!img->pipe && fseek(*fp,start,SEEK_SET))
         perror("Error: ");
-    haloposition = dim-(img->ancho*halosize*2);
-    // parallel for schedule static
-    // es una bottleneck llegir o escriure
-    // parallel inhibitor
-    // decidir static o dinamic https://stackoverflow.com/a/10852852
-    // llegir concurrentment val la pena? https://stackoverflow.com/a/11868557
-    for(i=0;i<dim;i++) {
-        // When start reading the halo store the position in the image file
-        if (halosize != 0 && i == haloposition) *position=ftell(*fp);
-        fscanf(*fp,"%d %d %d ",&img->R[i],&img->G[i],&img->B[i]);
-        k++;
-    }
-//    printf ("Readed = %d pixels, posicio=%lu\n",k,*position);
+    while (i<dim) {
+        n = dim - i;
+        if (img->map != NULL) {
+            // Unpack straight from the page cache, no intermediate buffer
+            data = img->map + start + i * pixel;
+        }
+        else if (img->uring != NULL) {
+            if (n > PPM_READBUFFER/pixel) n = PPM_READBUFFER/pixel;
+            data = (unsigned char *)img->uring->bufs[0];
+            if (uringRead(img->uring, fileno(*fp), 0, (char *)data, (size_t)n * pixel, start + i * pixel) != n * pixel) {
+                fprintf(stderr, "Error: unexpected end of P6 image data\n");
+                return -1;
+            }
+        }
+        else {
+            if (n > PPM_IOBUFFER/pixel) n = PPM_IOBUFFER/pixel;
+            if (fread(buffer, pixel, n, *fp) != (size_t)n) {
+                fprintf(stderr, "Error: unexpected end of P6 image data\n");
+                return -1;
+            }
+        }
+        unpackPixels(img, data, i, n);
+        i += n;
+    }
     return 0;
 }
 
-//Duplication of the  just readed source chunk to the destiny image struct chunk
-int duplicateImageChunk(ImagenData src, ImagenData dst, int dim){
-    int i=0;
+// Map the whole source file read-only. The mapping is followed by a zeroed page so the P3 parser
+// can always read a few bytes past the last number. Returns 0 on success.
+int mapImage(ImagenData img, FILE *fp){
+    struct stat st;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE), reserved;
+    unsigned char *area;
+    if (fstat(fileno(fp), &st) || st.st_size <= 0) return -1;
+    reserved = ((size_t)st.st_size / page + 2) * page;
+    area = mmap(NULL, reserved, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED) return -1;
+    if (mmap(area, (size_t)st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fileno(fp), 0) == MAP_FAILED) {
+        munmap(area, reserved);
+        return -1;
+    }
+    madvise(area, (size_t)st.st_size, MADV_SEQUENTIAL);
+    img->map = area;
+    img->mapsize = (size_t)st.st_size;
+    return 0;
+}
 
-    // parallel for scheduling dynamic o guided?
-    // parallel inhibitor
-    for(i=0;i<dim;i++){
-        dst->R[i] = src->R[i];
-        dst->G[i] = src->G[i];
-        dst->B[i] = src->B[i];
+// Prefetch len bytes of the mapping from offset, clipped to the file.
+void mapWillNeed(ImagenData img, long offset, long len){
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t from = ((size_t)offset / page) * page;
+    if (offset < 0 || len <= 0 || (size_t)offset >= img->mapsize) return;
+    if ((size_t)(offset + len) > img->mapsize) len = (long)(img->mapsize - offset);
+    madvise(img->map + from, (size_t)(offset + len) - from, MADV_WILLNEED);
+}
+
+// Load the row index sidecar of an ASCII image (<image>.idx), or build it and try to save it when it is
+// missing or does not match the image. Entry k is the file offset of the first number of row k*step.
+// Returns 0 when img->rowindex is ready.
+int loadRowIndex(ImagenData img, char *nombre, FILE *fp, int step){
+    char path[4096];
+    long header[PPM_INDEXHEADER], expected[PPM_INDEXHEADER];
+    struct stat st;
+    FILE *fidx;
+    int count = (img->altura + step - 1) / step;
+    if (img->P == 6 || img->P == 5 || step <= 0 || fstat(fileno(fp), &st)) return -1;
+    if (snprintf(path, sizeof(path), "%s.idx", nombre) >= (int)sizeof(path)) return -1;
+    expected[0] = PPM_INDEXMAGIC; expected[1] = (long)st.st_size; expected[2] = (long)st.st_mtime;
+    expected[3] = img->ancho; expected[4] = img->altura; expected[5] = step;
+    if ((img->rowindex = malloc(count * sizeof(long))) == NULL) return -1;
+    img->indexstep = step;
+    if ((fidx = fopen(path, "rb")) != NULL) {
+        if (fread(header, sizeof(long), PPM_INDEXHEADER, fidx) == PPM_INDEXHEADER &&
+            memcmp(header, expected, sizeof(header)) == 0 &&
+            fread(img->rowindex, sizeof(long), count, fidx) == (size_t)count) {
+            fclose(fidx);
+            return 0;
+        }
+        fclose(fidx);
+    }
+    if (buildRowIndex(img, fp)) {
+        free(img->rowindex);
+        img->rowindex = NULL;
+        return -1;
+    }
+    // A read-only image directory only costs rebuilding the index on the next run
+    if ((fidx = fopen(path, "wb")) != NULL) {
+        if (fwrite(expected, sizeof(long), PPM_INDEXHEADER, fidx) != PPM_INDEXHEADER ||
+            fwrite(img->rowindex, sizeof(long), count, fidx) != (size_t)count || fclose(fidx)) remove(path);
+    }
+    return 0;
+}
+
+// Scan the pixel data once and store the offset of the first number of every indexstep-th row.
+int buildRowIndex(ImagenData img, FILE *fp){
+    unsigned char *buffer;
+    long base = img->datapos, n, i, tokens = 0, rowtokens = (long)img->channels * img->ancho * img->indexstep;
+    int count = (img->altura + img->indexstep - 1) / img->indexstep, entry = 0, space = 1;
+    if (img->map != NULL) { buffer = img->map + base; n = (long)img->mapsize - base; }
+    else {
+        if ((buffer = malloc(PPM_READBUFFER)) == NULL) return -1;
+        if (fseek(fp, base, SEEK_SET)) { free(buffer); return -1; }
+        n = (long)fread(buffer, 1, PPM_READBUFFER, fp);
+    }
+    while (n > 0 && entry < count) {
+        for (i = 0; i < n; i++) {
+            if (buffer[i] > ' ' && space) {
+                if (tokens % rowtokens == 0 && entry < count) img->rowindex[entry++] = base + i;
+                tokens++;
+            }
+            space = buffer[i] <= ' ';
+        }
+        base += n;
+        if (img->map != NULL) n = 0;
+        else n = (long)fread(buffer, 1, PPM_READBUFFER, fp);
+    }
+    if (img->map == NULL) free(buffer);
+    return entry == count ? 0 : -1;
+}
+
+// File offset of a pixel of the image, or the pixel itself for tiled images. P6 and P5 pixels have a fixed size;
+// P3 and P2 pixels are found from the closest indexed row before them, skipping the numbers in between.
+long pixelPosition(ImagenData img, FILE *fp, long pixel){
+    unsigned char *buffer;
+    long base, n = 0, i = 0, skip;
+    int space = 1;
+    long row = pixel / img->ancho;
+    if (img->tiles != NULL) return pixel;
+    if (img->P == 6 || img->P == 5) return img->datapos + pixel * img->channels * (img->maxcolor > 255 ? 2 : 1);
+    if (img->rowindex == NULL || pixel < 0 || row >= img->altura) return -1;
+    base = img->rowindex[row / img->indexstep];
+    skip = img->channels * (pixel - (row / img->indexstep) * img->indexstep * (long)img->ancho);
+    if (skip == 0) return base;
+    if (img->map != NULL) { buffer = img->map + base; n = (long)img->mapsize - base; }
+    else {
+        if ((buffer = malloc(PPM_IOBUFFER)) == NULL) return -1;
+        if (fseek(fp, base, SEEK_SET)) { free(buffer); return -1; }
+        n = (long)fread(buffer, 1, PPM_IOBUFFER, fp);
+    }
+    while (n > 0) {
+        for (i = 0; i < n; i++) {
+            if (buffer[i] > ' ' && space && skip-- == 0) break;
+            space = buffer[i] <= ' ';
+        }
+        if (i < n || img->map != NULL) break;
+        base += n;
+        n = (long)fread(buffer, 1, PPM_IOBUFFER, fp);
+    }
+    if (img->map == NULL) free(buffer);
+    return (i < n) ? base + i : -1;
+}
+
+// Read the header and the tile offset table of a tiled image, the magic number already read from fp.
+// The header is P, width, height, maxcolor, tile width, tile height, pad, bytes per sample and the
+// comment length (TILE_HEADER unsigned ints in host byte order, like the row index), then the comment.
+int tiledOpen(ImagenData img, FILE *fp){
+    uint32_t h[TILE_HEADER];
+    TileInfo t;
+    long ntiles;
+    if (fread(h, sizeof(uint32_t), TILE_HEADER, fp) != TILE_HEADER) return -1;
+    if (h[1] == 0 || h[2] == 0 || h[4] == 0 || h[5] == 0 || h[6] > h[4] || h[6] > h[5] || (h[7] != 1 && h[7] != 2))
+        return -1;
+    if ((t = calloc(1, sizeof(struct tileinfo))) == NULL) return -1;
+    img->P = (int)h[0];
+    img->channels = (img->P == 2 || img->P == 5) ? 1 : 3;
+    img->ancho = (int)h[1];
+    img->altura = (int)h[2];
+    img->maxcolor = (int)h[3];
+    t->tilew = (int)h[4];
+    t->tileh = (int)h[5];
+    t->pad = (int)h[6];
+    t->bytes = (int)h[7];
+    t->tilesx = (img->ancho + t->tilew - 1) / t->tilew;
+    t->tilesy = (img->altura + t->tileh - 1) / t->tileh;
+    t->tilesize = (long)img->channels * (t->tilew + 2*t->pad) * (t->tileh + 2*t->pad) * t->bytes;
+    ntiles = (long)t->tilesx * t->tilesy;
+    img->tiles = t;
+    if ((img->comentario = calloc(h[8] + 1, sizeof(char))) == NULL ||
+        fread(img->comentario, 1, h[8], fp) != h[8]) return -1;
+    t->tablepos = ftell(fp);
+    if ((t->offsets = malloc(ntiles * sizeof(uint64_t))) == NULL ||
+        fread(t->offsets, sizeof(uint64_t), ntiles, fp) != (size_t)ntiles) return -1;
+    // Tiled images count positions in pixels
+    img->datapos = 0;
+    return 0;
+}
+
+// Start a tiled result file: write the header and the offset table, and size the file for all the tiles
+// so any tile that is never stored reads as zeros. The output must be seekable, tiles are written at
+// their own offsets.
+int tiledCreate(ImagenData img, FILE *fp, int tilesize, int pad){
+    uint32_t h[TILE_HEADER];
+    TileInfo t;
+    long ntiles, k;
+    if (lseek(fileno(fp), 0, SEEK_CUR) < 0) {
+        fprintf(stderr, "Error: tiled images can not be written to a pipe\n");
+        return -1;
+    }
+    if (tilesize <= 0) tilesize = TILE_SIZE;
+    if (pad < 0) pad = 0;
+    if (pad > tilesize) pad = tilesize;
+    if ((t = calloc(1, sizeof(struct tileinfo))) == NULL) return -1;
+    t->tilew = t->tileh = tilesize;
+    t->pad = pad;
+    t->bytes = (img->maxcolor > 255) ? 2 : 1;
+    t->tilesx = (img->ancho + t->tilew - 1) / t->tilew;
+    t->tilesy = (img->altura + t->tileh - 1) / t->tileh;
+    t->tilesize = (long)img->channels * (t->tilew + 2*t->pad) * (t->tileh + 2*t->pad) * t->bytes;
+    ntiles = (long)t->tilesx * t->tilesy;
+    img->tiles = t;
+    t->R = calloc((size_t)(t->tileh + 2*t->pad) * img->ancho, t->bytes);
+    if (img->channels == 3) {
+        t->G = calloc((size_t)(t->tileh + 2*t->pad) * img->ancho, t->bytes);
+        t->B = calloc((size_t)(t->tileh + 2*t->pad) * img->ancho, t->bytes);
+    }
+    if ((t->offsets = calloc(ntiles, sizeof(uint64_t))) == NULL || !t->R || (img->channels == 3 && (!t->G || !t->B))) return -1;
+    h[0] = img->P; h[1] = img->ancho; h[2] = img->altura; h[3] = img->maxcolor;
+    h[4] = t->tilew; h[5] = t->tileh; h[6] = t->pad; h[7] = t->bytes; h[8] = strlen(img->comentario);
+    fwrite(TILE_MAGIC, 1, 4, fp);
+    fwrite(h, sizeof(uint32_t), TILE_HEADER, fp);
+    fwrite(img->comentario, 1, h[8], fp);
+    t->tablepos = ftell(fp);
+    // Tiles follow the table in row order
+    for (k = 0; k < ntiles; k++)
+        t->offsets[k] = t->tablepos + ntiles * sizeof(uint64_t) + k * t->tilesize;
+    if (fwrite(t->offsets, sizeof(uint64_t), ntiles, fp) != (size_t)ntiles || fflush(fp) ||
+        ftruncate(fileno(fp), (off_t)t->offsets[0] + ntiles * t->tilesize)) return -1;
+    return 0;
+}
+
+// True when the file name asks for a tiled image.
+int tiledName(char *nombre){
+    size_t n = strlen(nombre);
+    return n > 4 && strcmp(nombre + n - 4, ".pct") == 0;
+}
+
+// Read the pixels [*position, *position+dim) of a tiled image; positions count pixels, not bytes.
+// Only the tile rows under the chunk are loaded (the halo rows come from their pad when it is wide
+// enough) and the tiles are read in parallel with pread, or straight from the mapping.
+int readTiles(ImagenData img, FILE **fp, long dim, int halosize, long *position){
+    TileInfo t = img->tiles;
+    long first = *position, last = *position + dim;
+    int y0 = (int)(first / img->ancho), y1 = (int)((last + img->ancho - 1) / img->ancho);
+    int core0 = y0, core1 = y1, ty0, ty1, ntiles, error = 0;
+    void *planes[3];
+    planes[0] = img->R; planes[1] = img->G; planes[2] = img->B;
+    // The rows within pad of the chunk ends can come from the pad of the tiles under the rest
+    if (y1 - y0 > 2*t->pad) { core0 = y0 + t->pad; core1 = y1 - t->pad; }
+    ty0 = core0 / t->tileh;
+    ty1 = (core1 - 1) / t->tileh;
+    ntiles = (ty1 - ty0 + 1) * t->tilesx;
+    *position = (halosize != 0) ? first + dim - 2L*img->ancho*halosize : last;
+#pragma omp parallel reduction(|:error)
+    {
+        unsigned char *buffer = NULL, *data;
+        int k, tx, ty, c, x, y, xlo, xhi, ylo, yhi;
+        int pw = t->tilew + 2*t->pad, ph = t->tileh + 2*t->pad;
+        long i, s;
+        if (img->map == NULL && (buffer = malloc(t->tilesize)) == NULL) error = 1;
+#pragma omp for schedule(dynamic)
+        for (k = 0; k < ntiles; k++) {
+            tx = k % t->tilesx;
+            ty = ty0 + k / t->tilesx;
+            data = buffer;
+            if (img->map != NULL) {
+                if (t->offsets[(long)ty*t->tilesx + tx] + t->tilesize > img->mapsize) { error = 1; continue; }
+                data = img->map + t->offsets[(long)ty*t->tilesx + tx];
+            }
+            else if (buffer == NULL ||
+                     pread(fileno(*fp), buffer, t->tilesize, (off_t)t->offsets[(long)ty*t->tilesx + tx]) != t->tilesize) {
+                error = 1;
+                continue;
+            }
+            // Every pixel is copied from one tile: its core, or the pad of the first and last tile rows
+            xlo = tx * t->tilew;
+            xhi = (xlo + t->tilew < img->ancho) ? xlo + t->tilew : img->ancho;
+            ylo = (ty == ty0) ? y0 : ty * t->tileh;
+            yhi = (ty == ty1) ? y1 : (ty + 1) * t->tileh;
+            for (c = 0; c < img->channels; c++)
+                for (y = ylo; y < yhi; y++)
+                    for (x = xlo; x < xhi; x++) {
+                        i = (long)y * img->ancho + x;
+                        if (i < first || i >= last) continue;
+                        s = (long)c*pw*ph + (long)(y - ty*t->tileh + t->pad)*pw + (x - xlo + t->pad);
+                        PUTSAMPLE(planes[c], img->bytes, i - first, (t->bytes == 1) ? data[s] : ((uint16_t *)data)[s]);
+                    }
+        }
+        free(buffer);
+    }
+    if (error) fprintf(stderr, "Error: can not read the tiles of rows %d-%d\n", y0, y1);
+    return error ? -1 : 0;
+}
+
+// Add the pixels [offset, offset+dim) of the image to the tiled result. Pixels go to the window of the
+// current tile row; a tile row is written as soon as the pad rows below it are in the window too.
+int saveTiles(ImagenData img, FILE **fp, long dim, long offset){
+    TileInfo t = img->tiles;
+    long total = (long)img->altura * img->ancho, full, n, top;
+    long ancho = img->ancho, keep;
+    int next;
+    // Once the last pixel is stored the tile rows left in the window are written too
+    while (dim > 0 || (t->stored == total && t->first < img->altura)) {
+        // The window holds rows first-pad .. first+tileh+pad-1
+        top = (long)(t->first - t->pad) * ancho;
+        full = (long)(t->first + t->tileh + t->pad) * ancho;
+        if (full > total) full = total;
+        n = full - t->stored;
+        if (n > dim) n = dim;
+        memcpy(SAMPLEAT(t->R, t->bytes, t->stored - top), SAMPLEAT(img->R, t->bytes, offset), n * t->bytes);
+        if (img->channels == 3) {
+            memcpy(SAMPLEAT(t->G, t->bytes, t->stored - top), SAMPLEAT(img->G, t->bytes, offset), n * t->bytes);
+            memcpy(SAMPLEAT(t->B, t->bytes, t->stored - top), SAMPLEAT(img->B, t->bytes, offset), n * t->bytes);
+        }
+        t->stored += n; offset += n; dim -= n;
+        if (t->stored < full) break;
+        if (storeTileRow(img, *fp)) return -1;
+        // Slide the window down one tile row, keeping the rows above the next one
+        next = t->first + t->tileh;
+        keep = t->stored - (next - t->pad) * ancho;
+        if (next < img->altura && keep > 0) {
+            memmove(t->R, SAMPLEAT(t->R, t->bytes, (long)t->tileh * ancho), keep * t->bytes);
+            if (img->channels == 3) {
+                memmove(t->G, SAMPLEAT(t->G, t->bytes, (long)t->tileh * ancho), keep * t->bytes);
+                memmove(t->B, SAMPLEAT(t->B, t->bytes, (long)t->tileh * ancho), keep * t->bytes);
+            }
+        }
+        t->first = next;
+        if (t->first >= img->altura) break;
+    }
+    return 0;
+}
+
+// Write the tiles of the tile row in the window of the tiled result, one tile per thread.
+int storeTileRow(ImagenData img, FILE *fp){
+    TileInfo t = img->tiles;
+    int ty = t->first / t->tileh, error = 0;
+    void *planes[3];
+    planes[0] = t->R; planes[1] = t->G; planes[2] = t->B;
+#pragma omp parallel reduction(|:error)
+    {
+        unsigned char *buffer = malloc(t->tilesize);
+        int tx, c, x, y, gx, gy, v;
+        int pw = t->tilew + 2*t->pad, ph = t->tileh + 2*t->pad;
+        long s;
+        if (buffer == NULL) error = 1;
+#pragma omp for schedule(dynamic)
+        for (tx = 0; tx < t->tilesx; tx++) {
+            if (buffer == NULL) continue;
+            for (c = 0, s = 0; c < img->channels; c++)
+                for (y = 0; y < ph; y++)
+                    for (x = 0; x < pw; x++, s++) {
+                        gy = t->first - t->pad + y;
+                        gx = tx * t->tilew - t->pad + x;
+                        v = 0;
+                        if (gy >= 0 && gy < img->altura && gx >= 0 && gx < img->ancho)
+                            v = GETSAMPLE(planes[c], t->bytes, (long)y * img->ancho + gx);
+                        if (t->bytes == 1) buffer[s] = (unsigned char)v;
+                        else ((uint16_t *)buffer)[s] = (uint16_t)v;
+                    }
+            if (pwriteAll(fileno(fp), (char *)buffer, t->tilesize, (off_t)t->offsets[(long)ty*t->tilesx + tx])) error = 1;
+        }
+        free(buffer);
+    }
+    return error ? -1 : 0;
+}
+
+void tiledDestroy(TileInfo t){
+    if (t == NULL) return;
+    free(t->offsets);
+    free(t->R);
+    free(t->G);
+    free(t->B);
+    free(t);
+}
+
+// Detect a gzip or zstd source by its magic number and start the thread that decompresses it into a pipe.
+// *fp becomes the read end, so the image is then read like any piped image. Returns 0 when the source is
+// not compressed (nothing is consumed) or the thread started, -1 on error.
+int codecOpen(ImagenData img, FILE **fp){
+    unsigned char magic[4];
+    int c, n = 1, type = 0, fds[2];
+    CodecStream s;
+    img->codec = NULL;
+    if ((c = fgetc(*fp)) != 0x1f && c != 0x28) {
+        if (c != EOF) ungetc(c, *fp);
+        return 0;
+    }
+    magic[0] = (unsigned char)c;
+    if (c == 0x1f) {
+        n += (int)fread(magic + 1, 1, 1, *fp);
+        if (n == 2 && magic[1] == 0x8b) type = CODEC_GZIP;
+    }
+    else {
+        n += (int)fread(magic + 1, 1, 3, *fp);
+        if (n == 4 && memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0) type = CODEC_ZSTD;
+    }
+    if (type == 0) {
+        fprintf(stderr, "Error: unknown image format\n");
+        return -1;
+    }
+#ifndef HAVE_ZLIB
+    if (type == CODEC_GZIP) { fprintf(stderr, "Error: gzip images need a build with -DHAVE_ZLIB -lz\n"); return -1; }
+#endif
+#ifndef HAVE_ZSTD
+    if (type == CODEC_ZSTD) { fprintf(stderr, "Error: zstd images need a build with -DHAVE_ZSTD -lzstd\n"); return -1; }
+#endif
+    if ((s = calloc(1, sizeof(struct codecstream))) == NULL || pipe(fds)) return -1;
+    s->type = type;
+    s->reading = 1;
+    s->file = *fp;
+    s->fd = fds[1];
+    memcpy(s->prefix, magic, n);
+    s->nprefix = n;
+    if (pthread_create(&s->thread, NULL, decompressStream, s) || (*fp = fdopen(fds[0], "r")) == NULL) {
+        perror("Error: ");
+        return -1;
+    }
+    img->codec = s;
+    return 0;
+}
+
+// Compression of a result file from its name: CODEC_GZIP for *.gz, CODEC_ZSTD for *.zst, 0 otherwise.
+int codecName(char *nombre){
+    size_t n = strlen(nombre);
+    if (n > 3 && strcmp(nombre + n - 3, ".gz") == 0) return CODEC_GZIP;
+    if (n > 4 && strcmp(nombre + n - 4, ".zst") == 0) return CODEC_ZSTD;
+    return 0;
+}
+
+// Decompressing thread: inflate the source into the pipe until the end of the source, or until the
+// reader closes the pipe. Concatenated gzip members and zstd frames (as savingChunk writes them) are
+// one stream.
+void *decompressStream(void *arg){
+    CodecStream s = (CodecStream)arg;
+    unsigned char *in = malloc(CODEC_BLOCK), *out = malloc(CODEC_BLOCK);
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+    size_t n = 0;
+#endif
+    int error = (in == NULL || out == NULL);
+    sigset_t set;
+    // A reader that stops early closes the pipe: get EPIPE here instead of a signal
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+    if (!error) {
+        memcpy(in, s->prefix, s->nprefix);
+        n = s->nprefix + fread(in + s->nprefix, 1, CODEC_BLOCK - s->nprefix, s->file);
+    }
+#endif
+#ifdef HAVE_ZLIB
+    if (!error && s->type == CODEC_GZIP) {
+        z_stream zs;
+        size_t len, k;
+        ssize_t w;
+        int r;
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, 15 + 32) != Z_OK) error = 1;
+        while (!error && n > 0) {
+            zs.next_in = in;
+            zs.avail_in = (uInt)n;
+            do {
+                zs.next_out = out;
+                zs.avail_out = CODEC_BLOCK;
+                r = inflate(&zs, Z_NO_FLUSH);
+                if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) error = 1;
+                for (len = CODEC_BLOCK - zs.avail_out, k = 0; !error && k < len; k += (size_t)w)
+                    if ((w = write(s->fd, out + k, len - k)) <= 0) error = 1;
+                if (r == Z_STREAM_END) inflateReset(&zs);
+            } while (!error && (zs.avail_in > 0 || zs.avail_out == 0));
+            n = fread(in, 1, CODEC_BLOCK, s->file);
+        }
+        inflateEnd(&zs);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (!error && s->type == CODEC_ZSTD) {
+        ZSTD_DStream *ds = ZSTD_createDStream();
+        ZSTD_inBuffer ib;
+        ZSTD_outBuffer ob;
+        size_t r, k;
+        ssize_t w;
+        if (ds == NULL || ZSTD_isError(ZSTD_initDStream(ds))) error = 1;
+        while (!error && n > 0) {
+            ib.src = in; ib.size = n; ib.pos = 0;
+            do {
+                ob.dst = out; ob.size = CODEC_BLOCK; ob.pos = 0;
+                r = ZSTD_decompressStream(ds, &ob, &ib);
+                if (ZSTD_isError(r)) error = 1;
+                for (k = 0; !error && k < ob.pos; k += (size_t)w)
+                    if ((w = write(s->fd, out + k, ob.pos - k)) <= 0) error = 1;
+            } while (!error && (ib.pos < ib.size || ob.pos == ob.size));
+            n = fread(in, 1, CODEC_BLOCK, s->file);
+        }
+        ZSTD_freeDStream(ds);
+    }
+#endif
+    if (error && errno != EPIPE) fprintf(stderr, "Error: can not decompress the source image\n");
+    close(s->fd);
+    fclose(s->file);
+    free(in);
+    free(out);
+    return NULL;
+}
+
+// Largest compressed size of a block of len bytes.
+size_t codecBound(int type, size_t len){
+#if !defined(HAVE_ZLIB) && !defined(HAVE_ZSTD)
+    (void)type;
+#endif
+#ifdef HAVE_ZSTD
+    if (type == CODEC_ZSTD) return ZSTD_compressBound(len);
+#endif
+#ifdef HAVE_ZLIB
+    // compressBound counts the zlib wrapper, a gzip header and trailer are a few bytes longer
+    if (type == CODEC_GZIP) return compressBound(len) + 32;
+#endif
+    return len;
+}
+
+// Compress len bytes of data into out (codecBound bytes) as one independent gzip member or zstd frame.
+// Returns the compressed length, 0 on error.
+size_t compressBlock(int type, const char *data, size_t len, char *out, size_t outlen){
+#if !defined(HAVE_ZLIB) && !defined(HAVE_ZSTD)
+    // No codec built in: nothing to compress with
+    (void)type; (void)data; (void)len; (void)out; (void)outlen;
+#endif
+#ifdef HAVE_ZLIB
+    if (type == CODEC_GZIP) {
+        z_stream zs;
+        size_t n;
+        int r;
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return 0;
+        zs.next_in = (Bytef *)data;
+        zs.avail_in = (uInt)len;
+        zs.next_out = (Bytef *)out;
+        zs.avail_out = (uInt)outlen;
+        r = deflate(&zs, Z_FINISH);
+        n = zs.total_out;
+        deflateEnd(&zs);
+        return (r == Z_STREAM_END) ? n : 0;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (type == CODEC_ZSTD) {
+        size_t n = ZSTD_compress(out, outlen, data, len, 3);
+        return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    return 0;
+}
+
+// Wait for the decompressing thread of a source (its pipe is already closed) and free the stream.
+void codecClose(CodecStream s){
+    if (s == NULL) return;
+    if (s->reading) pthread_join(s->thread, NULL);
+    free(s);
+}
+
+// Create an io_uring queue of the given depth with nbufs registered buffers of buflen bytes.
+// Returns NULL when io_uring is not available, so the caller keeps using stdio.
+UringQueue uringCreate(unsigned entries, int nbufs, size_t buflen){
+#ifdef HAVE_URING
+    struct io_uring_params p;
+    struct iovec *iov;
+    UringQueue q;
+    int i;
+    if ((q = calloc(1, sizeof(struct uringqueue))) == NULL) return NULL;
+    memset(&p, 0, sizeof(p));
+    if ((q->fd = (int)syscall(__NR_io_uring_setup, entries, &p)) < 0) { free(q); return NULL; }
+    q->entries = p.sq_entries;
+    q->sqringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    q->cqringsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (q->cqringsize > q->sqringsize) q->sqringsize = q->cqringsize;
+        q->cqringsize = 0;
+    }
+    q->sqring = mmap(NULL, q->sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQ_RING);
+    if (q->sqring == MAP_FAILED) { q->sqring = NULL; uringDestroy(q); return NULL; }
+    if (q->cqringsize > 0) {
+        q->cqring = mmap(NULL, q->cqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_CQ_RING);
+        if (q->cqring == MAP_FAILED) { q->cqring = NULL; uringDestroy(q); return NULL; }
+    }
+    else q->cqring = q->sqring;
+    q->sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+    q->sqes = mmap(NULL, q->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQES);
+    if (q->sqes == MAP_FAILED) { q->sqes = NULL; uringDestroy(q); return NULL; }
+    q->sqtail  = (unsigned *)((char *)q->sqring + p.sq_off.tail);
+    q->sqmask  = (unsigned *)((char *)q->sqring + p.sq_off.ring_mask);
+    q->sqarray = (unsigned *)((char *)q->sqring + p.sq_off.array);
+    q->cqhead  = (unsigned *)((char *)q->cqring + p.cq_off.head);
+    q->cqtail  = (unsigned *)((char *)q->cqring + p.cq_off.tail);
+    q->cqmask  = (unsigned *)((char *)q->cqring + p.cq_off.ring_mask);
+    q->cqes    = (char *)q->cqring + p.cq_off.cqes;
+    q->op     = calloc(q->entries, sizeof(int));
+    q->opfd   = calloc(q->entries, sizeof(int));
+    q->opbuf  = calloc(q->entries, sizeof(char *));
+    q->oplen  = calloc(q->entries, sizeof(size_t));
+    q->opoff  = calloc(q->entries, sizeof(long));
+    q->bufs   = calloc(nbufs, sizeof(char *));
+    iov = calloc(nbufs, sizeof(struct iovec));
+    if (!q->op || !q->opfd || !q->opbuf || !q->oplen || !q->opoff || !q->bufs || !iov) { free(iov); uringDestroy(q); return NULL; }
+    for (i = 0; i < nbufs; i++) {
+        if ((q->bufs[i] = malloc(buflen)) == NULL) { free(iov); uringDestroy(q); return NULL; }
+        q->nbufs++;
+        iov[i].iov_base = q->bufs[i];
+        iov[i].iov_len = buflen;
+    }
+    // Registered buffers are pinned once instead of on every request
+    if (syscall(__NR_io_uring_register, q->fd, IORING_REGISTER_BUFFERS, iov, nbufs) < 0) {
+        free(iov); uringDestroy(q); return NULL;
+    }
+    free(iov);
+    return q;
+#else
+    return NULL;
+#endif
+}
+
+// Release the queue and its buffers.
+void uringDestroy(UringQueue q){
+    int i;
+    if (q == NULL) return;
+    if (q->sqes != NULL) munmap(q->sqes, q->sqessize);
+    if (q->cqring != NULL && q->cqring != q->sqring) munmap(q->cqring, q->cqringsize);
+    if (q->sqring != NULL) munmap(q->sqring, q->sqringsize);
+    close(q->fd);
+    for (i = 0; i < q->nbufs; i++) free(q->bufs[i]);
+    free(q->bufs); free(q->op); free(q->opfd); free(q->opbuf); free(q->oplen); free(q->opoff);
+    free(q);
+}
+
+// Queue a read or write of len bytes at file offset off, split in URING_BLOCK requests. data must lie in
+// registered buffer buf. A full queue is drained first. Returns -1 on error.
+int uringQueue(UringQueue q, int write, int fd, int buf, char *data, size_t len, long off){
+#ifdef HAVE_URING
+    struct io_uring_sqe *sqe;
+    unsigned tail, slot;
+    size_t n;
+    while (len > 0) {
+        if (q->pending == q->entries && uringWait(q)) return -1;
+        n = (len > URING_BLOCK) ? URING_BLOCK : len;
+        slot = q->pending++;
+        tail = *q->sqtail;
+        sqe = &((struct io_uring_sqe *)q->sqes)[tail & *q->sqmask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->fd = fd;
+        sqe->addr = (unsigned long)data;
+        sqe->len = (unsigned)n;
+        sqe->off = (unsigned long)off;
+        sqe->buf_index = (unsigned short)buf;
+        sqe->user_data = slot;
+        q->sqarray[tail & *q->sqmask] = tail & *q->sqmask;
+        __atomic_store_n(q->sqtail, tail + 1, __ATOMIC_RELEASE);
+        q->op[slot] = write; q->opfd[slot] = fd; q->opbuf[slot] = data; q->oplen[slot] = n; q->opoff[slot] = off;
+        data += n; len -= n; off += (long)n;
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+// Submit the queued requests and wait for all of them. Short or failed requests are finished with
+// pread/pwrite; a read stops at the end of the file. Adds the bytes moved to q->transferred.
+int uringWait(UringQueue q){
+#ifdef HAVE_URING
+    struct io_uring_cqe *cqe;
+    unsigned head, submitted = 0, reaped = 0, slot;
+    long ret, res, done;
+    int error = 0;
+    while (reaped < q->pending) {
+        ret = syscall(__NR_io_uring_enter, q->fd, q->pending - submitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        submitted += (unsigned)ret;
+        head = *q->cqhead;
+        while (head != __atomic_load_n(q->cqtail, __ATOMIC_ACQUIRE)) {
+            cqe = &((struct io_uring_cqe *)q->cqes)[head & *q->cqmask];
+            slot = (unsigned)cqe->user_data;
+            done = (cqe->res > 0) ? cqe->res : 0;
+            head++;
+            reaped++;
+            while (done < (long)q->oplen[slot]) {
+                if (q->op[slot]) res = pwrite(q->opfd[slot], q->opbuf[slot] + done, q->oplen[slot] - done, q->opoff[slot] + done);
+                else res = pread(q->opfd[slot], q->opbuf[slot] + done, q->oplen[slot] - done, q->opoff[slot] + done);
+                if (res <= 0) break;
+                done += res;
+            }
+            if (q->op[slot] && done < (long)q->oplen[slot]) error = 1;
+            q->transferred += done;
+        }
+        __atomic_store_n(q->cqhead, head, __ATOMIC_RELEASE);
+    }
+    q->pending = 0;
+    return error ? -1 : 0;
+#else
+    return -1;
+#endif
+}
+
+// Read len bytes at offset off into registered buffer buf with several requests in flight.
+// Returns the bytes read (less at the end of the file) or -1.
+long uringRead(UringQueue q, int fd, int buf, char *data, size_t len, long off){
+    q->transferred = 0;
+    if (uringQueue(q, 0, fd, buf, data, len, off) || uringWait(q)) return -1;
+    return q->transferred;
+}
+
+//Duplication of the  just readed source chunk to the destiny image struct chunk
+int duplicateImageChunk(ImagenData src, ImagenData dst, long dim){
+    memcpy(dst->R, src->R, dim * src->bytes);
+    if (src->channels == 3) {
+        memcpy(dst->G, src->G, dim * src->bytes);
+        memcpy(dst->B, src->B, dim * src->bytes);
     }
-//    printf ("Duplicated = %d pixels\n",i);
     return 0;
 }
 
@@ -156,6 +1393,20 @@ kernelData leerKernel(char* nombre){
     int i=0;
     kernelData kern=NULL;
     
+    //The "-" kernel (identity) copies the image, to convert it between PPM and tiled files
+    if (strcmp(nombre, "-") == 0) {
+        kern=(kernelData) malloc(sizeof(struct structkernel));
+        kern->kernelX = kern->kernelY = 1;
+        kern->vkern = (float *)malloc(sizeof(float));
+        kern->vkern[0] = 1.0f;
+        kern->spec = NULL;
+        separateKernel(kern);
+        //A weight of 1 is exact in floats, so CONV_FIXED has nothing to quantize or report here
+        kern->qkern = NULL;
+        kern->qpair = NULL;
+        kern->qshift = 0;
+        return kern;
+    }
     /*Opening the kernel file*/
     fp=fopen(nombre,"r");
     if(!fp){
@@ -177,41 +1428,319 @@ kernelData leerKernel(char* nombre){
         }
         fscanf(fp,"%f",&kern->vkern[i]);
         fclose(fp);
+        //Outer product kernels (box, Gaussian) run as two 1D passes
+        kern->spec = NULL;
+        separateKernel(kern);
+        //CONV_FIXED=1 also keeps 16-bit weights, reporting their rounding error
+        quantizeKernel(kern);
     }
     return kern;
 }
 
+// Detect a separable (rank one) kernel: kernel[m][n] = col[m]*row[n] within KERNEL_SEPTOL of the largest weight.
+// The factors are the row and the column through the largest weight. Kernels that would not save work
+// (1xN, Nx1, 2x2) and CONV_SEPARABLE=0 keep the 2D convolution.
+void separateKernel(kernelData kern){
+    int kx = kern->kernelX, ky = kern->kernelY, m, n, pm = 0, pn = 0;
+    float big = 0, pivot;
+    char *env = getenv("CONV_SEPARABLE");
+    kern->separable = 0;
+    kern->row = kern->col = NULL;
+    if (kx * ky <= kx + ky || (env != NULL && !atoi(env))) return;
+    for (m = 0; m < ky; m++)
+        for (n = 0; n < kx; n++)
+            if (fabsf(kern->vkern[m*kx + n]) > big) { big = fabsf(kern->vkern[m*kx + n]); pm = m; pn = n; }
+    if (big == 0) return;
+    kern->row = (float *)malloc(kx * sizeof(float));
+    kern->col = (float *)malloc(ky * sizeof(float));
+    if (kern->row == NULL || kern->col == NULL) goto dense;
+    pivot = kern->vkern[pm*kx + pn];
+    for (n = 0; n < kx; n++) kern->row[n] = kern->vkern[pm*kx + n];
+    for (m = 0; m < ky; m++) kern->col[m] = kern->vkern[m*kx + pn] / pivot;
+    for (m = 0; m < ky; m++)
+        for (n = 0; n < kx; n++)
+            if (fabs((double)kern->col[m] * kern->row[n] - kern->vkern[m*kx + n]) > KERNEL_SEPTOL * big) goto dense;
+    kern->separable = 1;
+    return;
+dense:
+    free(kern->row);
+    free(kern->col);
+    kern->row = kern->col = NULL;
+}
+
+// Fixed-point weights (CONV_FIXED=1): qkern = vkern * 2^qshift rounded to 16 bits, with the largest qshift that
+// keeps every weight in an int16 and the sums of 8-bit samples in an int32. The worst-case error against the
+// float weights (all the samples 0 or 255, whichever adds up the quantization errors) is reported on stderr.
+// The weights of every kernel row are also packed two by two (an odd last one with 0) for the SIMD kernels.
+void quantizeKernel(kernelData kern){
+    int n = kern->kernelX * kern->kernelY, i, m, shift;
+    int pairs = (kern->kernelX + 1) / 2;            // weight pairs of a kernel row
+    long q, total;
+    double e, up, down;
+    char *env = getenv("CONV_FIXED");
+    kern->qkern = NULL;
+    kern->qpair = NULL;
+    kern->qshift = 0;
+    if (env == NULL || !atoi(env)) return;
+    if ((kern->qkern = (int16_t *)malloc(n * sizeof(int16_t))) == NULL) return;
+    if ((kern->qpair = (int32_t *)malloc(kern->kernelY * pairs * sizeof(int32_t))) == NULL) {
+        free(kern->qkern);
+        kern->qkern = NULL;
+        return;
+    }
+    for (shift = 30; shift >= 0; shift--) {
+        total = 1L << shift >> 1;                   // rounding of the sums
+        for (i = 0; i < n; i++) {
+            q = lrint(ldexp(kern->vkern[i], shift));
+            if (q > INT16_MAX || q < -INT16_MAX) break;
+            kern->qkern[i] = (int16_t)q;
+            total += labs(q) * 255;
+        }
+        if (i == n && total <= INT32_MAX) break;
+    }
+    if (shift < 0) {
+        fprintf(stderr, "Warning: the kernel weights do not fit in 16 bits, CONV_FIXED is ignored\n");
+        free(kern->qkern);
+        free(kern->qpair);
+        kern->qkern = NULL;
+        kern->qpair = NULL;
+        return;
+    }
+    kern->qshift = shift;
+    for (m = 0; m < kern->kernelY; m++)
+        for (i = 0; i < kern->kernelX; i += 2)
+            kern->qpair[m * pairs + i / 2] = (int32_t)((uint16_t)kern->qkern[m * kern->kernelX + i] |
+                (uint32_t)(uint16_t)((i + 1 < kern->kernelX) ? kern->qkern[m * kern->kernelX + i + 1] : 0) << 16);
+    up = down = 0;
+    for (i = 0; i < n; i++) {
+        e = kern->vkern[i] - ldexp(kern->qkern[i], -shift);
+        if (e > 0) up += e;
+        else down -= e;
+    }
+    fprintf(stderr, "Fixed-point kernel: 16-bit weights / 2^%d, worst-case error %g levels of 255 (before rounding)\n",
+            shift, 255 * ((up > down) ? up : down));
+}
+
 // Open the image file with the convolution results
 int initfilestore(ImagenData img, FILE **fp, char* nombre, long *position){
     /*Se crea el fichero con la imagen resultante*/
-    if ( (*fp=fopen(nombre,"w")) == NULL ){
+    if (strcmp(nombre, "-") == 0) {
+        //"-" writes the image to stdout. The timing report moves to stderr, so it does not end up in the image.
+        if ((*fp = fdopen(dup(STDOUT_FILENO), "w")) == NULL || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            perror("Error: ");
+            return -1;
+        }
+    }
+    else if ( (*fp=fopen(nombre,"w")) == NULL ){
         perror("Error: ");
         return -1;
     }
+    //Tiled results keep their own header and offset table (CONV_TILE=<size>[,<pad>])
+    if (tiledName(nombre)) {
+        *position = 0;
+        return tiledCreate(img, *fp, getenv("CONV_TILE") ? atoi(getenv("CONV_TILE")) : TILE_SIZE,
+                           (getenv("CONV_TILE") && strchr(getenv("CONV_TILE"), ',')) ? atoi(strchr(getenv("CONV_TILE"), ',') + 1) : 0);
+    }
+    //Results named *.gz or *.zst are compressed in independent blocks by the threads of savingChunk
+    if ((img->codec = codecName(nombre) ? calloc(1, sizeof(struct codecstream)) : NULL) != NULL) {
+        img->codec->type = codecName(nombre);
+        if (codecBound(img->codec->type, 1) == 1) {
+            fprintf(stderr, "Error: %s results need a build with %s\n", img->codec->type == CODEC_GZIP ? "gzip" : "zstd",
+                    img->codec->type == CODEC_GZIP ? "-DHAVE_ZLIB -lz" : "-DHAVE_ZSTD -lzstd");
+            return -1;
+        }
+    }
+    //One registered write buffer for every thread of savingChunk
+    if (img->codec == NULL && getenv("CONV_URING") != NULL && atoi(getenv("CONV_URING"))) {
+        int nbufs = 1;
+#ifdef _OPENMP
+        nbufs = omp_get_max_threads();
+#endif
+        if ((img->uring = uringCreate(URING_DEPTH, nbufs, PPM_WRITEBUFFER + PPM_MAXPIXEL)) == NULL)
+            fprintf(stderr, "Warning: io_uring is not available, writing %s with stdio\n", nombre);
+    }
     /*Writing Image Header*/
-    fprintf(*fp,"P%d\n%s\n%d %d\n%d\n",img->P,img->comentario,img->ancho,img->altura,img->maxcolor);
+    if (img->codec != NULL) {
+        char header[400], packed[600];
+        size_t len = snprintf(header, sizeof(header), "P%d\n%s\n%d %d\n%d\n", img->P, img->comentario, img->ancho, img->altura, img->maxcolor);
+        if ((len = compressBlock(img->codec->type, header, len, packed, sizeof(packed))) == 0 || fwrite(packed, 1, len, *fp) != len)
+            return -1;
+    }
+    else fprintf(*fp,"P%d\n%s\n%d %d\n%d\n",img->P,img->comentario,img->ancho,img->altura,img->maxcolor);
     *position = ftell(*fp);
     return 0;
 }
 
 // Writing the image partition to the resulting file. dim is the exact size to write. offset is the displacement for avoid halos.
-int savingChunk(ImagenData img, FILE **fp, int dim, int offset){
-    int i,k=0;
-    // Writing image partition
-    // parallel for scheduling static
-    // parallel inhibittor
-    for(i=offset;i<dim+offset;i++){
-        fprintf(*fp,"%d %d %d ",img->R[i],img->G[i],img->B[i]);
-//        if ((i+1)%6==0) fprintf(*fp,"\n");
-        k++;
-    }
-//    printf ("Writed = %d pixels, dim=%d, offset=%d\n",k,dim, offset);
+int savingChunk(ImagenData img, FILE **fp, long dim, long offset){
+    size_t *lens;
+    long base=0;
+    int nthreads=1, error=0, seekable=0;
+    int per = PPM_WRITEBUFFER / PPM_MAXPIXEL;    // pixels formatted by one thread in one round
+    if (img->tiles != NULL) return saveTiles(img, fp, dim, offset);
+    // Writing image partition. Threads format consecutive pixel ranges in private buffers; a prefix sum
+    // of the lengths gives the file offset of every range, which is then written with pwrite. Compressed
+    // results compress every range as an independent block first (pigz style).
+    fflush(*fp);
+    base = ftell(*fp);
+    seekable = base >= 0 && lseek(fileno(*fp), 0, SEEK_CUR) >= 0;
+#ifdef _OPENMP
+    nthreads = omp_get_max_threads();
+    if (nthreads > dim / per + 1) nthreads = (int)(dim / per) + 1;
+#endif
+    // With io_uring every thread formats into its registered buffer
+    if (img->uring != NULL && nthreads > img->uring->nbufs) nthreads = img->uring->nbufs;
+    if ((lens = calloc(nthreads + 1, sizeof(size_t))) == NULL) return -1;
+#pragma omp parallel num_threads(nthreads) reduction(|:error)
+    {
+        int t = 0, threads = 1, k;
+        long r, from, to;
+        size_t len, total;
+        off_t mystart;
+        char *buffer, *packed = NULL, *out;
+        size_t bound = 0;
+#ifdef _OPENMP
+        t = omp_get_thread_num();
+        threads = omp_get_num_threads();
+#endif
+        if (img->uring != NULL) buffer = img->uring->bufs[t];
+        else if ((buffer = malloc(PPM_WRITEBUFFER + PPM_MAXPIXEL)) == NULL) error = 1;
+        if (img->codec != NULL) {
+            bound = codecBound(img->codec->type, PPM_WRITEBUFFER + PPM_MAXPIXEL);
+            if ((packed = malloc(bound)) == NULL) error = 1;
+        }
+        // Every thread runs the same rounds, so the barriers match even after an error
+        for (r = 0; r < dim; r += (long)per * threads) {
+            from = offset + r + (long)per * t;
+            to   = from + per;
+            if (to > offset + dim) to = offset + dim;
+            if (from > to) from = to;
+            len = (buffer != NULL) ? formatPixels(img, buffer, from, to) : 0;
+            out = buffer;
+            if (packed != NULL && len > 0) {
+                if ((len = compressBlock(img->codec->type, buffer, len, packed, bound)) == 0) error = 1;
+                out = packed;
+            }
+            lens[t+1] = len;
+#pragma omp barrier
+#pragma omp single
+            for (k = 1; k <= threads; k++) lens[k] += lens[k-1];
+            mystart = (off_t)base + (off_t)lens[t];
+            total = lens[threads];
+            if (seekable && img->uring != NULL) {
+                // One thread keeps the writes of all the ranges in flight
+#pragma omp single
+                {
+                    for (k = 0; k < threads; k++)
+                        if (lens[k+1] > lens[k] &&
+                            uringQueue(img->uring, 1, fileno(*fp), k, img->uring->bufs[k], lens[k+1] - lens[k], base + (long)lens[k]))
+                            error = 1;
+                    if (uringWait(img->uring)) error = 1;
+                }
+            }
+            else if (seekable) {
+                if (len > 0 && pwriteAll(fileno(*fp), out, len, mystart)) error = 1;
+            }
+            else {
+                // Pipes can not seek: write the ranges in order through the stream
+#pragma omp for ordered schedule(static, 1)
+                for (k = 0; k < threads; k++) {
+#pragma omp ordered
+                    if (len > 0 && fwrite(out, 1, len, *fp) != len) error = 1;
+                }
+            }
+#pragma omp barrier
+#pragma omp single
+            base += (long)total;
+        }
+        if (img->uring == NULL) free(buffer);
+        free(packed);
+    }
+    free(lens);
+    // Leave the stream after the written data
+    if (seekable && fseek(*fp, base, SEEK_SET)) return -1;
+    return error ? -1 : 0;
+}
+
+// Write len bytes of buffer at offset of the file descriptor fd, retrying after partial writes.
+int pwriteAll(int fd, const char *buffer, size_t len, off_t offset){
+    ssize_t n;
+    while (len > 0) {
+        if ((n = pwrite(fd, buffer, len, offset)) <= 0) return -1;
+        buffer += n; len -= (size_t)n; offset += n;
+    }
     return 0;
 }
 
+// Format the pixels [from, to) of the image in buffer as the file stores them and return the length.
+// P3 uses the "%d %d %d " text and P2 "%d ", P6 and P5 one byte per sample up to maxcolor 255 and two
+// (big-endian) above.
+size_t formatPixels(ImagenData img, char *buffer, long from, long to){
+    size_t len=0;
+    long i=0;
+    int c=0, v=0;
+    void *planes[3];
+    planes[0] = img->R; planes[1] = img->G; planes[2] = img->B;
+    if (img->P == 3) {
+        for(i=from;i<to;i++){
+            len += formatInteger(buffer + len, GETSAMPLE(img->R, img->bytes, i)); buffer[len++] = ' ';
+            len += formatInteger(buffer + len, GETSAMPLE(img->G, img->bytes, i)); buffer[len++] = ' ';
+            len += formatInteger(buffer + len, GETSAMPLE(img->B, img->bytes, i)); buffer[len++] = ' ';
+        }
+        return len;
+    }
+    if (img->P == 2) {
+        for(i=from;i<to;i++){
+            len += formatInteger(buffer + len, GETSAMPLE(img->R, img->bytes, i)); buffer[len++] = ' ';
+        }
+        return len;
+    }
+    for(i=from;i<to;i++){
+        for (c=0;c<img->channels;c++) {
+            v = GETSAMPLE(planes[c], img->bytes, i);
+            if (img->bytes == 2) buffer[len++] = (char)(v >> 8);
+            buffer[len++] = (char)v;
+        }
+    }
+    return len;
+}
+
+// Two ASCII digits for every value 0..99, used to format integers two digits at a time.
+const char digitPairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Write value in decimal at s, the same text as printf("%d"). Returns the number of bytes written.
+int formatInteger(char *s, int value){
+    char tmp[12];
+    int k=12, len=0;
+    unsigned int u = (unsigned int)value, q;
+    if (value < 0) { s[len++] = '-'; u = 0u - u; }
+    while (u >= 100) {
+        q = u / 100;
+        k -= 2;
+        memcpy(tmp + k, digitPairs + 2 * (u - q * 100), 2);
+        u = q;
+    }
+    if (u >= 10) { k -= 2; memcpy(tmp + k, digitPairs + 2 * u, 2); }
+    else tmp[--k] = (char)('0' + u);
+    memcpy(s + len, tmp + k, 12 - k);
+    return len + 12 - k;
+}
+
 // This function free the space allocated for the image structure.
 void freeImagestructure(ImagenData *src){
     
+    if ((*src)->map != NULL)
+        munmap((*src)->map, ((*src)->mapsize / sysconf(_SC_PAGESIZE) + 2) * sysconf(_SC_PAGESIZE));
+    free((*src)->rowindex);
+    free((*src)->carry);
+    uringDestroy((*src)->uring);
+    tiledDestroy((*src)->tiles);
+    codecClose((*src)->codec);
     free((*src)->comentario);
     free((*src)->R);
     free((*src)->G);
@@ -230,101 +1759,1403 @@ void freeImagestructure(ImagenData *src){
 // pointer indexing in order to minimize the number of multiplications.
 //
 //
-// signed integer (32bit) version:
+// signed integer (32bit) version. With channels > 1 the plane holds interleaved samples (RGBRGB...): a tap
+// steps over channels samples, so every weight is applied to all the channels of the pixels in one sweep.
 ///////////////////////////////////////////////////////////////////////////////
-int convolve2D(int* in, int* out, int dataSizeX, int dataSizeY,
+int convolve2D(int* in, int* out, int dataSizeX, int dataSizeY, int channels,
                float* kernel, int kernelSizeX, int kernelSizeY)
 {
-    int i, j, m, n;
-    int *inPtr, *inPtr2, *outPtr;
-    float *kPtr;
+    int i;
     int kCenterX, kCenterY;
-    int rowMin, rowMax;                             // to check boundary of input array
-    int colMin, colMax;                             //
-    float sum;                                      // temp accumulation buffer
-    
+    int rowFirst, rowLast;                          // interior: the whole kernel is inside the plane
+    int colFirst, colLast;                          //
+    InteriorKernel interior = interiorKernel();             // SIMD version for this CPU
+    UnrolledKernel unrolled = unrolledKernel(kernelSizeX, kernelSizeY);     // or the one for this size, if any
+
     // check validity of params
     if(!in || !out || !kernel) return -1;
-    if(dataSizeX <= 0 || kernelSizeX <= 0) return -1;
-    
+    if(dataSizeX <= 0 || kernelSizeX <= 0 || channels <= 0) return -1;
+
     // find center position of kernel (half of kernel size)
     kCenterX = (int)kernelSizeX / 2;
     kCenterY = (int)kernelSizeY / 2;
-    
-    // init working  pointers
-    inPtr = inPtr2 = &in[dataSizeX * kCenterY + kCenterX];  // note that  it is shifted (kCenterX, kCenterY),
-    outPtr = out;
-    kPtr = kernel;
-    int *initial_in = inPtr;
-    int *initial_out = out;
-    
+
+    // The taps only need the bounds checks within kernelSize/2 of the edges
+    rowFirst = kernelSizeY - 1 - kCenterY;
+    rowLast = dataSizeY - kCenterY;
+    colFirst = kernelSizeX - 1 - kCenterX;
+    colLast = dataSizeX - kCenterX;
+    if (colLast < colFirst) colFirst = colLast = dataSizeX;
+
     // start convolution
-#pragma omp parallel num_threads(4) private(sum, i, rowMax, rowMin, j, m, n, colMax, colMin) firstprivate(kPtr, inPtr, inPtr2, outPtr)
+#pragma omp parallel num_threads(4) private(i)
 {
     int id 	   = omp_get_thread_num();
     int numthreads = omp_get_num_threads();
 
-    inPtr2 = inPtr2 + id;
-    inPtr  = inPtr2;
-    outPtr = outPtr + id;
-
-    // start convolution
-    for(i= 0; i < dataSizeY; ++i)                   // number of rows
+    // rows dealt round robin to the threads
+    for(i = id; i < dataSizeY; i += numthreads)   // number of rows
     {
-        // compute the range of convolution, the current row of kernel should be between these
-        rowMax = i + kCenterY;
-        rowMin = i - dataSizeY + kCenterY;
-
-        for(j = id; j < dataSizeX; j+=numthreads)              // number of columns
-        {
-            // compute the range of convolution, the current column of kernel should be between these
-            colMax = j + kCenterX;
-            colMin = j - dataSizeX + kCenterX;
-
-            sum = 0;                                // set to 0 before accumulate
-
-            // flip the kernel and traverse all the kernel values
-            // multiply each kernel value with underlying input data
-            for(m = 0; m < kernelSizeY; ++m)        // kernel rows
-            {
-                // check if the index is out of bound of input array
-                if(m <= rowMax && m > rowMin)
-                {
-                    for(n = 0; n < kernelSizeX; ++n)
-                    {
-                        // check the boundary of array
-                        if(n <= colMax && n > colMin)
-                            sum += *(inPtr - n) * *kPtr;
-
-                        ++kPtr;                     // next kernel
-                    }
-                }
-                else
-                    kPtr += kernelSizeX;            // out of bound, move to next row of kernel
-
-                inPtr -= dataSizeX;                 // move input data 1 raw up
-            }
-
-            // convert integer number
-            if(sum >= 0) *outPtr = (int)(sum + 0.5f);
-//            else *outPtr = (int)(sum - 0.5f)*(-1);
-            // For using with image editors like GIMP or others...
-            else *outPtr = (int)(sum - 0.5f);
-            // For using with a text editor that read ppm images like libreoffice or others...
-//            else *outPtr = 0;
-
-            kPtr = kernel;                          // reset kernel to (0,0)
-
-            inPtr2 = inPtr2 + numthreads;
-            inPtr  = inPtr2;                       // next input
-            outPtr = outPtr + numthreads;          // next output
+        int *outRow = out + (long)i * dataSizeX * channels;
+        if (i < rowFirst || i >= rowLast)
+            convolveClipped(in, outRow, dataSizeX, dataSizeY, channels, kernel, kernelSizeX, kernelSizeY, i, 0, dataSizeX * channels);
+        else {
+            // thin border strips with the checks, interior without them
+            convolveClipped(in, outRow, dataSizeX, dataSizeY, channels, kernel, kernelSizeX, kernelSizeY, i,
+                            0, colFirst * channels);
+            if (unrolled != NULL)
+                unrolled(in, outRow, dataSizeX, channels, kernel, i, colFirst * channels, colLast * channels);
+            else
+                interior(in, outRow, dataSizeX, channels, kernel, kernelSizeX, kernelSizeY, i,
+                         colFirst * channels, colLast * channels);
+            convolveClipped(in, outRow, dataSizeX, dataSizeY, channels, kernel, kernelSizeX, kernelSizeY, i,
+                            colLast * channels, dataSizeX * channels);
         }
     }
 }//End parallel
     return 0;
 }
 
-
+// Samples from..to-1 of row i near the edges: the taps outside the plane are skipped (zero padding).
+void convolveClipped(int* in, int* out, int dataSizeX, int dataSizeY, int channels, float* kernel, int kernelSizeX,
+                     int kernelSizeY, int i, int from, int to)
+{
+    int j, m, n;
+    int *inPtr, *inPtr2;
+    float *kPtr;
+    int kCenterX = kernelSizeX / 2, kCenterY = kernelSizeY / 2;
+    long rowLen = (long)dataSizeX * channels;       // samples of a row
+    int rowMin, rowMax;                             // to check boundary of input array
+    int colMin, colMax;                             //
+    float sum;                                      // temp accumulation buffer
+
+    // compute the range of convolution, the current row of kernel should be between these
+    rowMax = i + kCenterY;
+    rowMin = i - dataSizeY + kCenterY;
+
+    inPtr2 = in + (i + kCenterY) * rowLen + from + kCenterX * channels;   // note that  it is shifted (kCenterX, kCenterY),
+    for (j = from; j < to; ++j)                     // number of samples
+    {
+        // compute the range of convolution, the current column of kernel should be between these
+        colMax = j / channels + kCenterX;
+        colMin = j / channels - dataSizeX + kCenterX;
+
+        sum = 0;                                    // set to 0 before accumulate
+        inPtr = inPtr2;
+        kPtr = kernel;
+
+        // flip the kernel and traverse all the kernel values
+        // multiply each kernel value with underlying input data
+        for (m = 0; m < kernelSizeY; ++m)            // kernel rows
+        {
+            // check if the index is out of bound of input array
+            if (m <= rowMax && m > rowMin) {
+                for (n = 0; n < kernelSizeX; ++n) {
+                    // check the boundary of array
+                    if (n <= colMax && n > colMin)
+                        sum += *(inPtr - n * channels) * *kPtr;
+                    ++kPtr;                         // next kernel
+                }
+            } else
+                kPtr += kernelSizeX;                // out of bound, move to next row of kernel
+            inPtr -= rowLen;                        // move input data 1 raw up
+        }
+
+        // convert integer number
+        if (sum >= 0) out[j] = (int)(sum + 0.5f);
+        // For using with image editors like GIMP or others...
+        else out[j] = (int)(sum - 0.5f);
+
+        ++inPtr2;                                   // next input
+    }
+}
+
+// Samples from..to-1 of row i with the whole kernel inside the plane: no bounds checks, and every tap is applied
+// to CONV_BLOCK samples of the row at once, so the inner loop is a plain vectorizable sweep. Each sample still adds
+// its taps in the order of convolveClipped, giving the same result.
+void convolveInterior(int* in, int* out, int dataSizeX, int channels, float* kernel, int kernelSizeX, int kernelSizeY,
+                      int i, int from, int to)
+{
+    float acc[CONV_BLOCK];
+    int j, k, m, n, len;
+    int kCenterX = kernelSizeX / 2, kCenterY = kernelSizeY / 2;
+    int *inPtr;
+    float w;
+
+    for (j = from; j < to; j += CONV_BLOCK) {
+        len = (to - j < CONV_BLOCK) ? to - j : CONV_BLOCK;
+        for (k = 0; k < len; k++) acc[k] = 0;
+        for (m = 0; m < kernelSizeY; ++m)            // kernel rows
+            for (n = 0; n < kernelSizeX; ++n) {
+                w = kernel[m * kernelSizeX + n];
+                inPtr = in + (long)(i + kCenterY - m) * dataSizeX * channels + j + (kCenterX - n) * channels;
+#pragma omp simd
+                for (k = 0; k < len; k++) acc[k] += inPtr[k] * w;
+            }
+        // convert integer number
+        for (k = 0; k < len; k++)
+            out[j + k] = (acc[k] >= 0) ? (int)(acc[k] + 0.5f) : (int)(acc[k] - 0.5f);
+    }
+}
+
+// convolveInterior unrolled at compile time for a K x K kernel (3x3, 5x5 and 7x7, see interiorKernel): the K*K
+// taps of a sample are expanded, so the weights stay in registers over the whole row. Every sample still adds its
+// taps in the order of convolveInterior, giving the same result.
+#define INTERIOR_UNROLLED(K)                                                                                   \
+void convolveInterior##K##x##K(int* in, int* out, int dataSizeX, int channels, float* kernel,                  \
+                               int i, int from, int to)                                                        \
+{                                                                                                              \
+    int j, t;                                                                                                  \
+    long rowLen = (long)dataSizeX * channels;                                                                  \
+    int *inPtr = in + (long)(i + K / 2) * rowLen + K / 2 * channels;     /* tap (0, 0) of sample 0 */          \
+    float w[K * K];                                                                                            \
+    for (t = 0; t < K * K; t++) w[t] = kernel[t];                                                              \
+    _Pragma("omp simd")                                                                                        \
+    for (j = from; j < to; j++) {                                                                              \
+        float sum = 0;                                                                                         \
+        _Pragma("GCC unroll 49")                                                                               \
+        for (t = 0; t < K * K; t++) sum += inPtr[j - t / K * rowLen - t % K * channels] * w[t];                \
+        out[j] = (int)(sum + ((sum >= 0) ? 0.5f : -0.5f));                                                     \
+    }                                                                                                          \
+}
+INTERIOR_UNROLLED(3)
+INTERIOR_UNROLLED(5)
+INTERIOR_UNROLLED(7)
+#undef INTERIOR_UNROLLED
+
+#ifdef HAVE_X86_SIMD
+// AVX2 interior: 8 pixels per vector and 4 vectors of sums kept in registers over all the taps. Products and
+// sums are separate instructions (no FMA), so the pixels get the same float rounding as convolveInterior.
+__attribute__((target("avx2")))
+void convolveInteriorAVX2(int* in, int* out, int dataSizeX, int channels, float* kernel, int kernelSizeX,
+                          int kernelSizeY, int i, int from, int to)
+{
+    int j, m, n;
+    int kCenterX = kernelSizeX / 2, kCenterY = kernelSizeY / 2;
+    int *inPtr;
+    __m256 w, s0, s1, s2, s3, sign = _mm256_set1_ps(-0.0f), half = _mm256_set1_ps(0.5f);
+
+    for (j = from; j + 8 <= to; j += (j + 32 <= to) ? 32 : 8) {
+        s0 = s1 = s2 = s3 = _mm256_setzero_ps();
+        for (m = 0; m < kernelSizeY; ++m)            // kernel rows
+            for (n = 0; n < kernelSizeX; ++n) {
+                w = _mm256_set1_ps(kernel[m * kernelSizeX + n]);
+                inPtr = in + (long)(i + kCenterY - m) * dataSizeX * channels + j + (kCenterX - n) * channels;
+                s0 = _mm256_add_ps(s0, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((__m256i *)inPtr)), w));
+                if (j + 32 > to) continue;
+                s1 = _mm256_add_ps(s1, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((__m256i *)(inPtr + 8))), w));
+                s2 = _mm256_add_ps(s2, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((__m256i *)(inPtr + 16))), w));
+                s3 = _mm256_add_ps(s3, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((__m256i *)(inPtr + 24))), w));
+            }
+        // convert integer number: add 0.5 with the sign of the sum and truncate
+        _mm256_storeu_si256((__m256i *)(out + j), _mm256_cvttps_epi32(_mm256_add_ps(s0, _mm256_or_ps(half, _mm256_and_ps(s0, sign)))));
+        if (j + 32 > to) continue;
+        _mm256_storeu_si256((__m256i *)(out + j + 8), _mm256_cvttps_epi32(_mm256_add_ps(s1, _mm256_or_ps(half, _mm256_and_ps(s1, sign)))));
+        _mm256_storeu_si256((__m256i *)(out + j + 16), _mm256_cvttps_epi32(_mm256_add_ps(s2, _mm256_or_ps(half, _mm256_and_ps(s2, sign)))));
+        _mm256_storeu_si256((__m256i *)(out + j + 24), _mm256_cvttps_epi32(_mm256_add_ps(s3, _mm256_or_ps(half, _mm256_and_ps(s3, sign)))));
+    }
+    // last pixels of the row
+    convolveInterior(in, out, dataSizeX, channels, kernel, kernelSizeX, kernelSizeY, i, j, to);
+}
+
+// AVX2 interior unrolled over the K columns of a K x K kernel. The 16 vector registers can not hold the
+// weights next to the sums, so they are broadcast from memory: all the taps of a row in one straight run.
+// Only 3x3 gains from it, 5x5 and 7x7 run as fast with convolveInteriorAVX2 and take that one.
+#define ROUND256(s) _mm256_cvttps_epi32(_mm256_add_ps(s, _mm256_or_ps(half, _mm256_and_ps(s, sign))))
+#define INTERIOR_UNROLLED_AVX2(K)                                                                                      \
+__attribute__((target("avx2")))                                                                                        \
+void convolveInterior##K##x##K##AVX2(int* in, int* out, int dataSizeX, int channels, float* kernel,                    \
+                                   int i, int from, int to)                                                            \
+{                                                                                                                      \
+    int j, m, n;                                                                                                       \
+    long rowLen = (long)dataSizeX * channels;                                                                          \
+    int *inPtr = in + (long)(i + K / 2) * rowLen + K / 2 * channels, *p;                                               \
+    __m256 w, s0, s1, s2, s3, sign = _mm256_set1_ps(-0.0f), half = _mm256_set1_ps(0.5f);                               \
+    for (j = from; j + 32 <= to; j += 32) {                                                                            \
+        s0 = s1 = s2 = s3 = _mm256_setzero_ps();                                                                       \
+        for (m = 0; m < K; m++) {                                                                                      \
+            _Pragma("GCC unroll 7")                                                                                    \
+            for (n = 0; n < K; n++) {                                                                                  \
+                w = _mm256_broadcast_ss(kernel + m * K + n);                                                           \
+                p = inPtr + j - m * rowLen - n * channels;                                                             \
+                s0 = _mm256_add_ps(s0, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((__m256i *)p)), w));        \
+                s1 = _mm256_add_ps(s1, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((__m256i *)(p + 8))), w));  \
+                s2 = _mm256_add_ps(s2, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((__m256i *)(p + 16))), w)); \
+                s3 = _mm256_add_ps(s3, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((__m256i *)(p + 24))), w)); \
+            }                                                                                                          \
+        }                                                                                                              \
+        _mm256_storeu_si256((__m256i *)(out + j), ROUND256(s0));                                                       \
+        _mm256_storeu_si256((__m256i *)(out + j + 8), ROUND256(s1));                                                   \
+        _mm256_storeu_si256((__m256i *)(out + j + 16), ROUND256(s2));                                                  \
+        _mm256_storeu_si256((__m256i *)(out + j + 24), ROUND256(s3));                                                  \
+    }                                                                                                                  \
+    /* last pixels of the row */                                                                                       \
+    convolveInterior##K##x##K(in, out, dataSizeX, channels, kernel, i, j, to);                                         \
+}
+INTERIOR_UNROLLED_AVX2(3)
+#undef INTERIOR_UNROLLED_AVX2
+#undef ROUND256
+
+// AVX-512 interior: as the AVX2 one with 16 pixels per vector. The explicitly rounded products and sums keep
+// the compiler from fusing them, as it may with plain intrinsics where FMA is available.
+#define EXACT (_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+// convert integer number: add 0.5 with the sign of the sum and truncate
+#define ROUND512(s) _mm512_cvttps_epi32(_mm512_add_ps(s, _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(half), \
+                        _mm512_and_si512(_mm512_castps_si512(s), sign)))))
+__attribute__((target("avx512f")))
+void convolveInteriorAVX512(int* in, int* out, int dataSizeX, int channels, float* kernel, int kernelSizeX,
+                            int kernelSizeY, int i, int from, int to)
+{
+    int j, m, n;
+    int kCenterX = kernelSizeX / 2, kCenterY = kernelSizeY / 2;
+    int *inPtr;
+    __m512 w, s0, s1, s2, s3, half = _mm512_set1_ps(0.5f);
+    __m512i sign = _mm512_set1_epi32(0x80000000);
+
+    for (j = from; j + 16 <= to; j += (j + 64 <= to) ? 64 : 16) {
+        s0 = s1 = s2 = s3 = _mm512_setzero_ps();
+        for (m = 0; m < kernelSizeY; ++m)            // kernel rows
+            for (n = 0; n < kernelSizeX; ++n) {
+                w = _mm512_set1_ps(kernel[m * kernelSizeX + n]);
+                inPtr = in + (long)(i + kCenterY - m) * dataSizeX * channels + j + (kCenterX - n) * channels;
+                s0 = _mm512_add_round_ps(s0, _mm512_mul_round_ps(_mm512_cvtepi32_ps(_mm512_loadu_si512(inPtr)), w, EXACT), EXACT);
+                if (j + 64 > to) continue;
+                s1 = _mm512_add_round_ps(s1, _mm512_mul_round_ps(_mm512_cvtepi32_ps(_mm512_loadu_si512(inPtr + 16)), w, EXACT), EXACT);
+                s2 = _mm512_add_round_ps(s2, _mm512_mul_round_ps(_mm512_cvtepi32_ps(_mm512_loadu_si512(inPtr + 32)), w, EXACT), EXACT);
+                s3 = _mm512_add_round_ps(s3, _mm512_mul_round_ps(_mm512_cvtepi32_ps(_mm512_loadu_si512(inPtr + 48)), w, EXACT), EXACT);
+            }
+        // convert integer number
+        _mm512_storeu_si512(out + j, ROUND512(s0));
+        if (j + 64 > to) continue;
+        _mm512_storeu_si512(out + j + 16, ROUND512(s1));
+        _mm512_storeu_si512(out + j + 32, ROUND512(s2));
+        _mm512_storeu_si512(out + j + 48, ROUND512(s3));
+    }
+    // last pixels of the row
+    convolveInterior(in, out, dataSizeX, channels, kernel, kernelSizeX, kernelSizeY, i, j, to);
+}
+
+// AVX-512 interior unrolled for a K x K kernel, with the exactly rounded products and sums of the generic one.
+// The 32 vector registers keep the 3x3 and 5x5 weights broadcast next to the sums for the whole row.
+#define INTERIOR_UNROLLED_AVX512(K)                                                                                                \
+__attribute__((target("avx512f")))                                                                                                 \
+void convolveInterior##K##x##K##AVX512(int* in, int* out, int dataSizeX, int channels, float* kernel,                              \
+                                     int i, int from, int to)                                                                      \
+{                                                                                                                                  \
+    int j, t;                                                                                                                      \
+    long rowLen = (long)dataSizeX * channels;                                                                                      \
+    int *inPtr = in + (long)(i + K / 2) * rowLen + K / 2 * channels, *p;                                                           \
+    __m512 w[K * K], s0, s1, s2, s3, half = _mm512_set1_ps(0.5f);                                                                  \
+    __m512i sign = _mm512_set1_epi32(0x80000000);                                                                                  \
+    for (t = 0; t < K * K; t++) w[t] = _mm512_set1_ps(kernel[t]);                                                                  \
+    for (j = from; j + 64 <= to; j += 64) {                                                                                        \
+        s0 = s1 = s2 = s3 = _mm512_setzero_ps();                                                                                   \
+        _Pragma("GCC unroll 49")                                                                                                   \
+        for (t = 0; t < K * K; t++) {                                                                                              \
+            p = inPtr + j - t / K * rowLen - t % K * channels;                                                                     \
+            s0 = _mm512_add_round_ps(s0, _mm512_mul_round_ps(_mm512_cvtepi32_ps(_mm512_loadu_si512(p)), w[t], EXACT), EXACT);      \
+            s1 = _mm512_add_round_ps(s1, _mm512_mul_round_ps(_mm512_cvtepi32_ps(_mm512_loadu_si512(p + 16)), w[t], EXACT), EXACT); \
+            s2 = _mm512_add_round_ps(s2, _mm512_mul_round_ps(_mm512_cvtepi32_ps(_mm512_loadu_si512(p + 32)), w[t], EXACT), EXACT); \
+            s3 = _mm512_add_round_ps(s3, _mm512_mul_round_ps(_mm512_cvtepi32_ps(_mm512_loadu_si512(p + 48)), w[t], EXACT), EXACT); \
+        }                                                                                                                          \
+        _mm512_storeu_si512(out + j, ROUND512(s0));                                                                                \
+        _mm512_storeu_si512(out + j + 16, ROUND512(s1));                                                                           \
+        _mm512_storeu_si512(out + j + 32, ROUND512(s2));                                                                           \
+        _mm512_storeu_si512(out + j + 48, ROUND512(s3));                                                                           \
+    }                                                                                                                              \
+    /* last pixels of the row */                                                                                                   \
+    convolveInterior##K##x##K(in, out, dataSizeX, channels, kernel, i, j, to);                                                     \
+}
+INTERIOR_UNROLLED_AVX512(3)
+INTERIOR_UNROLLED_AVX512(5)
+INTERIOR_UNROLLED_AVX512(7)
+#undef INTERIOR_UNROLLED_AVX512
+#undef ROUND512
+#undef EXACT
+#endif
+
+// Widest SIMD level of the convolution kernels for this CPU: 2 AVX-512, 1 AVX2, 0 the portable loops.
+// CONV_SIMD=avx512|avx2|scalar caps it, so one binary runs (and can be compared) on every node. It is resolved
+// on the first call, every band then takes its kernels without asking the environment and the CPU again.
+int simdLevel(void)
+{
+    static int level = -1;
+    char *env;
+    if (level >= 0) return level;
+    env = getenv("CONV_SIMD");
+    level = 0;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if ((env == NULL || strcmp(env, "avx512") == 0) && __builtin_cpu_supports("avx512f")) level = 2;
+    else if ((env == NULL || strcmp(env, "scalar") != 0) && __builtin_cpu_supports("avx2")) level = 1;
+#endif
+    (void)env;
+    return level;
+}
+
+// Interior kernel for this CPU: AVX-512, AVX2 or the portable one (see simdLevel).
+InteriorKernel interiorKernel(void)
+{
+#ifdef HAVE_X86_SIMD
+    if (simdLevel() == 2) return convolveInteriorAVX512;
+    if (simdLevel() == 1) return convolveInteriorAVX2;
+#endif
+    return convolveInterior;
+}
+
+// Interior kernel unrolled for a ksizeX x ksizeY kernel on this CPU, NULL when there is none and interiorKernel
+// runs it: 3x3, 5x5 and 7x7 (only 3x3 with AVX2), unless CONV_UNROLL=0.
+UnrolledKernel unrolledKernel(int ksizeX, int ksizeY)
+{
+    static int unroll = -1;
+    int k = ksizeX;
+    if (unroll < 0) unroll = getenv("CONV_UNROLL") == NULL || atoi(getenv("CONV_UNROLL"));
+    if (!unroll || ksizeX != ksizeY) return NULL;
+#ifdef HAVE_X86_SIMD
+    if (simdLevel() == 2)
+        return (k == 3) ? convolveInterior3x3AVX512 : (k == 5) ? convolveInterior5x5AVX512 :
+               (k == 7) ? convolveInterior7x7AVX512 : NULL;
+    if (simdLevel() == 1) return (k == 3) ? convolveInterior3x3AVX2 : NULL;
+#endif
+    return (k == 3) ? convolveInterior3x3 : (k == 5) ? convolveInterior5x5 : (k == 7) ? convolveInterior7x7 : NULL;
+}
+
+// Fixed-point version of convolve2D (CONV_FIXED=1) for samples up to 255, widened by widenFixed: the weights are
+// kern->qkern / 2^qshift, every tap is an integer multiply-add into an int32 sum and the sum is rounded (half up)
+// and shifted once per sample. quantizeKernel keeps the sums inside 32 bits. With a SIMD kernel for this CPU the
+// samples come in the pairs of int16 of widenFixed (paired), else as plain int16. Only the output rows
+// rowFrom..rowTo-1 are worked out: the rows of the halo of a band of convolvePlanes only feed the taps.
+int convolveFixed(void* in, int* out, int dataSizeX, int dataSizeY, int channels, kernelData kern, int rowFrom,
+                  int rowTo)
+{
+    int i;
+    int kernelSizeX = kern->kernelX, kernelSizeY = kern->kernelY;
+    int kCenterX = kernelSizeX / 2, kCenterY = kernelSizeY / 2;
+    int rowFirst, rowLast;                          // interior: the whole kernel is inside the plane
+    int colFirst, colLast;                          //
+    FixedKernel interior = fixedKernel();           // SIMD version for this CPU, NULL without one
+    int paired = interior != NULL;
+
+    if(!in || !out || !kern->qkern) return -1;
+    if(dataSizeX <= 0 || channels <= 0) return -1;
+
+    rowFirst = kernelSizeY - 1 - kCenterY;
+    rowLast = dataSizeY - kCenterY;
+    colFirst = kernelSizeX - 1 - kCenterX;
+    colLast = dataSizeX - kCenterX;
+    if (colLast < colFirst) colFirst = colLast = dataSizeX;
+
+    // start convolution
+#pragma omp parallel num_threads(4) private(i)
+{
+    int id 	   = omp_get_thread_num();
+    int numthreads = omp_get_num_threads();
+
+    // rows dealt round robin to the threads
+    for(i = rowFrom + id; i < rowTo; i += numthreads)   // number of rows
+    {
+        int *outRow = out + (long)i * dataSizeX * channels;
+        if (i < rowFirst || i >= rowLast)
+            convolveFixedClipped(in, paired, outRow, dataSizeX, dataSizeY, channels, kern, i, 0, dataSizeX * channels);
+        else {
+            // thin border strips with the checks, interior without them
+            convolveFixedClipped(in, paired, outRow, dataSizeX, dataSizeY, channels, kern, i, 0, colFirst * channels);
+            if (paired) interior(in, outRow, dataSizeX, channels, kern, i, colFirst * channels, colLast * channels);
+            else convolveInteriorFixed(in, outRow, dataSizeX, channels, kern, i, colFirst * channels, colLast * channels);
+            convolveFixedClipped(in, paired, outRow, dataSizeX, dataSizeY, channels, kern, i, colLast * channels,
+                                 dataSizeX * channels);
+        }
+    }
+}//End parallel
+    return 0;
+}
+
+// Samples from..to-1 of row i of convolveFixed near the edges: only the kernel rows m and columns n that fall
+// inside the plane are added (zero padding). Paired samples are read from the low halves.
+void convolveFixedClipped(void* in, int paired, int* out, int dataSizeX, int dataSizeY, int channels,
+                          kernelData kern, int i, int from, int to)
+{
+    int j, m, n, sum;
+    int kCenterX = kern->kernelX / 2, kCenterY = kern->kernelY / 2;
+    int rowMin, rowMax, colMin, colMax;
+    long rowLen = (long)dataSizeX * channels;       // samples of a row
+    long s;
+    int16_t *qPtr;
+
+    // input row i + kCenterY - m is inside the plane
+    rowMin = (i + kCenterY - dataSizeY + 1 > 0) ? i + kCenterY - dataSizeY + 1 : 0;
+    rowMax = (i + kCenterY < kern->kernelY - 1) ? i + kCenterY : kern->kernelY - 1;
+    for (j = from; j < to; ++j) {
+        // input column j / channels + kCenterX - n is inside the plane
+        colMin = (j / channels + kCenterX - dataSizeX + 1 > 0) ? j / channels + kCenterX - dataSizeX + 1 : 0;
+        colMax = (j / channels + kCenterX < kern->kernelX - 1) ? j / channels + kCenterX : kern->kernelX - 1;
+        sum = 0;
+        for (m = rowMin; m <= rowMax; ++m) {
+            s = (i + kCenterY - m) * rowLen + j + kCenterX * channels;
+            qPtr = kern->qkern + m * kern->kernelX;
+            for (n = colMin; n <= colMax; ++n)
+                sum += (paired ? ((int32_t *)in)[s - n * channels] & 0xffff : ((int16_t *)in)[s - n * channels]) * qPtr[n];
+        }
+        out[j] = FIXEDROUND(sum, kern->qshift);
+    }
+}
+
+// Samples from..to-1 of row i of convolveFixed with the whole kernel inside the plane, CONV_BLOCK at a time as in
+// convolveInterior, over plain int16 samples: the int16 x int16 products of a tap are widened into the sums by
+// the compiler (pmullw/pmulhw, smlal), with twice the samples of an int32 vector per instruction.
+void convolveInteriorFixed(int16_t* in, int* out, int dataSizeX, int channels, kernelData kern, int i, int from, int to)
+{
+    int acc[CONV_BLOCK];
+    int j, k, m, n, len;
+    int16_t w;
+    long rowLen = (long)dataSizeX * channels;
+    int16_t *inPtr = in + (long)(i + kern->kernelY / 2) * rowLen + kern->kernelX / 2 * channels;   // tap 0 of sample 0
+    int16_t *p;
+
+    for (j = from; j < to; j += CONV_BLOCK) {
+        len = (to - j < CONV_BLOCK) ? to - j : CONV_BLOCK;
+        for (k = 0; k < len; k++) acc[k] = 0;
+        for (m = 0; m < kern->kernelY; ++m)            // kernel rows
+            for (n = 0; n < kern->kernelX; ++n) {
+                w = kern->qkern[m * kern->kernelX + n];
+                p = inPtr + j - m * rowLen - n * channels;
+#pragma omp simd
+                for (k = 0; k < len; k++) acc[k] += p[k] * w;
+            }
+#pragma omp simd
+        for (k = 0; k < len; k++) out[j + k] = FIXEDROUND(acc[k], kern->qshift);
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+// Last samples from..to-1 of row i of the SIMD kernels below, one at a time with the pairs of qpair.
+void convolveInteriorFixedPairs(int32_t* in, int* out, int dataSizeX, int channels, kernelData kern, int i, int from,
+                                int to)
+{
+    int j, m, n, sum;
+    int pairs = (kern->kernelX + 1) / 2;            // weight pairs of a kernel row
+    long rowLen = (long)dataSizeX * channels;
+    int32_t *inPtr = in + (long)(i + kern->kernelY / 2) * rowLen + kern->kernelX / 2 * channels;   // tap 0 of sample 0
+    int32_t v, w;
+
+    for (j = from; j < to; ++j) {
+        sum = 0;
+        for (m = 0; m < kern->kernelY; ++m)            // kernel rows
+            for (n = 0; n < kern->kernelX; n += 2) {   // taps n and n + 1
+                v = inPtr[j - m * rowLen - n * channels];
+                w = kern->qpair[m * pairs + n / 2];
+                sum += (v & 0xffff) * (int16_t)(w & 0xffff) + (v >> 16) * (w >> 16);
+            }
+        out[j] = FIXEDROUND(sum, kern->qshift);
+    }
+}
+
+// AVX2 fixed-point interior over the sample pairs of widenFixed: the 32-bit lane of a sample holds it together with
+// the sample of the next tap of the kernel row, so one pmaddwd (_mm256_madd_epi16) against the weight pair of
+// qpair adds the products of two taps for 8 samples, in the order of the output. 32 samples of a row are worked at
+// once (8 at the end), in 4 vectors of sums kept in registers over all the taps.
+__attribute__((target("avx2")))
+void convolveInteriorFixedAVX2(int32_t* in, int* out, int dataSizeX, int channels, kernelData kern, int i, int from,
+                               int to)
+{
+    int j, m, n;
+    int pairs = (kern->kernelX + 1) / 2;            // weight pairs of a kernel row
+    long rowLen = (long)dataSizeX * channels;
+    int32_t *inPtr = in + (long)(i + kern->kernelY / 2) * rowLen + kern->kernelX / 2 * channels;   // tap 0 of sample 0
+    int32_t *p, *qpair;
+    __m256i w, s0, s1, s2, s3, half = _mm256_set1_epi32(1 << kern->qshift >> 1);
+    __m128i shift = _mm_cvtsi32_si128(kern->qshift);
+
+    for (j = from; j + 8 <= to; j += (j + 32 <= to) ? 32 : 8) {
+        s0 = s1 = s2 = s3 = _mm256_setzero_si256();
+        for (m = 0; m < kern->kernelY; ++m) {          // kernel rows
+            qpair = kern->qpair + m * pairs;
+            for (n = 0; n < kern->kernelX; n += 2) {   // taps n and n + 1
+                w = _mm256_set1_epi32(qpair[n / 2]);
+                p = inPtr + j - m * rowLen - n * channels;
+                s0 = _mm256_add_epi32(s0, _mm256_madd_epi16(_mm256_loadu_si256((__m256i *)p), w));
+                if (j + 32 > to) continue;
+                s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(_mm256_loadu_si256((__m256i *)(p + 8)), w));
+                s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(_mm256_loadu_si256((__m256i *)(p + 16)), w));
+                s3 = _mm256_add_epi32(s3, _mm256_madd_epi16(_mm256_loadu_si256((__m256i *)(p + 24)), w));
+            }
+        }
+        _mm256_storeu_si256((__m256i *)(out + j), _mm256_sra_epi32(_mm256_add_epi32(s0, half), shift));
+        if (j + 32 > to) continue;
+        _mm256_storeu_si256((__m256i *)(out + j + 8), _mm256_sra_epi32(_mm256_add_epi32(s1, half), shift));
+        _mm256_storeu_si256((__m256i *)(out + j + 16), _mm256_sra_epi32(_mm256_add_epi32(s2, half), shift));
+        _mm256_storeu_si256((__m256i *)(out + j + 24), _mm256_sra_epi32(_mm256_add_epi32(s3, half), shift));
+    }
+    // last pixels of the row
+    convolveInteriorFixedPairs(in, out, dataSizeX, channels, kern, i, j, to);
+}
+
+// AVX-512 fixed-point interior: as the AVX2 one with 64 samples at once (16 at the end). _mm512_madd_epi16 needs
+// AVX512BW.
+__attribute__((target("avx512f,avx512bw")))
+void convolveInteriorFixedAVX512(int32_t* in, int* out, int dataSizeX, int channels, kernelData kern, int i, int from,
+                                 int to)
+{
+    int j, m, n;
+    int pairs = (kern->kernelX + 1) / 2;            // weight pairs of a kernel row
+    long rowLen = (long)dataSizeX * channels;
+    int32_t *inPtr = in + (long)(i + kern->kernelY / 2) * rowLen + kern->kernelX / 2 * channels;   // tap 0 of sample 0
+    int32_t *p, *qpair;
+    __m512i w, s0, s1, s2, s3, half = _mm512_set1_epi32(1 << kern->qshift >> 1);
+    __m128i shift = _mm_cvtsi32_si128(kern->qshift);
+
+    for (j = from; j + 16 <= to; j += (j + 64 <= to) ? 64 : 16) {
+        s0 = s1 = s2 = s3 = _mm512_setzero_si512();
+        for (m = 0; m < kern->kernelY; ++m) {          // kernel rows
+            qpair = kern->qpair + m * pairs;
+            for (n = 0; n < kern->kernelX; n += 2) {   // taps n and n + 1
+                w = _mm512_set1_epi32(qpair[n / 2]);
+                p = inPtr + j - m * rowLen - n * channels;
+                s0 = _mm512_add_epi32(s0, _mm512_madd_epi16(_mm512_loadu_si512(p), w));
+                if (j + 64 > to) continue;
+                s1 = _mm512_add_epi32(s1, _mm512_madd_epi16(_mm512_loadu_si512(p + 16), w));
+                s2 = _mm512_add_epi32(s2, _mm512_madd_epi16(_mm512_loadu_si512(p + 32), w));
+                s3 = _mm512_add_epi32(s3, _mm512_madd_epi16(_mm512_loadu_si512(p + 48), w));
+            }
+        }
+        _mm512_storeu_si512(out + j, _mm512_sra_epi32(_mm512_add_epi32(s0, half), shift));
+        if (j + 64 > to) continue;
+        _mm512_storeu_si512(out + j + 16, _mm512_sra_epi32(_mm512_add_epi32(s1, half), shift));
+        _mm512_storeu_si512(out + j + 32, _mm512_sra_epi32(_mm512_add_epi32(s2, half), shift));
+        _mm512_storeu_si512(out + j + 48, _mm512_sra_epi32(_mm512_add_epi32(s3, half), shift));
+    }
+    // last pixels of the row
+    convolveInteriorFixedPairs(in, out, dataSizeX, channels, kern, i, j, to);
+}
+#endif
+
+// Fixed-point interior kernel for this CPU over paired samples, at most of the level of simdLevel, or NULL when
+// there is none and convolveInteriorFixed runs over plain int16 samples. The AVX-512 one needs AVX512BW.
+FixedKernel fixedKernel(void)
+{
+#ifdef HAVE_X86_SIMD
+    if (simdLevel() == 2 && __builtin_cpu_supports("avx512bw")) return convolveInteriorFixedAVX512;
+    if (simdLevel() >= 1) return convolveInteriorFixedAVX2;
+#endif
+    return NULL;
+}
+
+// Run the kernel over the channels planes in[c] of compact samples (bytes 1 or 2) into out[c]. Bands of
+// CONV_BANDROWS output rows are widened to int together with their kernel halo, convolved and stored back
+// saturated to [0, maxcolor], so the int buffers hold one band and not the planes. Outside the planes the
+// samples still count as zero, the bands give the pixels of a whole plane convolution. A band that would
+// go through convolve2D is convolved for all the channels in one pass: it is widened interleaved (RGBRGB...)
+// and convolve2D loads every weight once for the samples of all the channels. Else every channel goes
+// through convolveBand on its own. With fixed-point weights (CONV_FIXED=1) 8-bit bands are widened to int16 or
+// int16 pairs (widenFixed) and take convolveFixed in place of convolve2D.
+int convolvePlanes(void** in, void** out, int channels, int dataSizeX, int dataSizeY, int bytes, int maxcolor,
+                   kernelData kern)
+{
+    int above = kern->kernelY - 1 - kern->kernelY / 2, below = kern->kernelY / 2;
+    int band = (8 * (kern->kernelY - 1) > CONV_BANDROWS) ? 8 * (kern->kernelY - 1) : CONV_BANDROWS;
+    int s, e, a, b, c, error = 0;
+    int fixed = kern->qkern != NULL && bytes == 1;
+    long len;
+    int *wide, *conv;
+
+    if(!in || !out) return -1;
+    if(dataSizeX <= 0 || dataSizeY <= 0) return 0;
+    if (band > dataSizeY) band = dataSizeY;
+    len = (long)(band + above + below) * dataSizeX * channels;
+    wide = malloc(len * sizeof(int));
+    conv = malloc(len * sizeof(int));
+    if (wide == NULL || conv == NULL) {
+        free(wide);
+        free(conv);
+        return -1;
+    }
+    for (s = 0; s < dataSizeY && !error; s = e) {
+        // Output rows [s, e) need the input rows [a, b)
+        e = (s + band < dataSizeY) ? s + band : dataSizeY;
+        a = (s - above > 0) ? s - above : 0;
+        b = (e + below < dataSizeY) ? e + below : dataSizeY;
+        if ((channels == 3 || fixed) && !kern->separable && !fftWorth(kern, dataSizeX, b - a)) {
+            if (fixed) widenFixed(in, channels, (long)a * dataSizeX, (long)(b - a) * dataSizeX, fixedKernel() != NULL,
+                                  wide);
+            else widenSamples(in, channels, bytes, (long)a * dataSizeX, (long)(b - a) * dataSizeX, wide);
+            if (fixed ? convolveFixed(wide, conv, dataSizeX, b - a, channels, kern, s - a, e - a)
+                      : convolve2D(wide, conv, dataSizeX, b - a, channels, kern->vkern, kern->kernelX, kern->kernelY))
+                error = 1;
+            else storeSamples(conv + (long)(s - a) * dataSizeX * channels, out, channels, bytes, maxcolor,
+                              (long)s * dataSizeX, (long)(e - s) * dataSizeX);
+            continue;
+        }
+        for (c = 0; c < channels && !error; c++) {
+            widenSamples(in + c, 1, bytes, (long)a * dataSizeX, (long)(b - a) * dataSizeX, wide);
+            if (convolveBand(wide, conv, dataSizeX, b - a, kern)) error = 1;
+            else storeSamples(conv + (long)(s - a) * dataSizeX, out + c, 1, bytes, maxcolor, (long)s * dataSizeX,
+                              (long)(e - s) * dataSizeX);
+        }
+    }
+    free(wide);
+    free(conv);
+    return error ? -1 : 0;
+}
+
+// Widen n samples of the planes of compact samples, from pixel first, into ints. channels is 1 (PGM) or 3 (PPM):
+// the three planes are interleaved pixel by pixel (RGBRGB...).
+void widenSamples(void** planes, int channels, int bytes, long first, long n, int* dst)
+{
+#pragma omp parallel num_threads(4)
+{
+    int id 	   = omp_get_thread_num();
+    int numthreads = omp_get_num_threads();
+    // Every thread converts one contiguous slice
+    long i, lo = n * id / numthreads, hi = n * (id + 1) / numthreads;
+    if (channels == 3 && bytes == 1) {
+        uint8_t *r = (uint8_t *)planes[0] + first, *g = (uint8_t *)planes[1] + first, *b = (uint8_t *)planes[2] + first;
+#pragma omp simd
+        for (i = lo; i < hi; i++) {
+            dst[3 * i] = r[i];
+            dst[3 * i + 1] = g[i];
+            dst[3 * i + 2] = b[i];
+        }
+    }
+    else if (channels == 3) {
+        uint16_t *r = (uint16_t *)planes[0] + first, *g = (uint16_t *)planes[1] + first, *b = (uint16_t *)planes[2] + first;
+#pragma omp simd
+        for (i = lo; i < hi; i++) {
+            dst[3 * i] = r[i];
+            dst[3 * i + 1] = g[i];
+            dst[3 * i + 2] = b[i];
+        }
+    }
+    else if (bytes == 1) {
+        uint8_t *p = (uint8_t *)planes[0] + first;
+#pragma omp simd
+        for (i = lo; i < hi; i++)
+            dst[i] = p[i];
+    }
+    else {
+        uint16_t *p = (uint16_t *)planes[0] + first;
+#pragma omp simd
+        for (i = lo; i < hi; i++)
+            dst[i] = p[i];
+    }
+}//End parallel
+}
+
+// Widen n 8-bit samples of the planes, from pixel first, for convolveFixed, interleaved as in widenSamples when
+// channels is 3: into int16 samples or, with paired, into 32-bit lanes holding a sample in the low half and the
+// sample of the same channel of the pixel before (tap n + 1 of a kernel row) in the high half. The high half of
+// the first pixel of a row only ever meets 0 weights.
+void widenFixed(void** planes, int channels, long first, long n, int paired, void* dst)
+{
+    int16_t *d16 = dst;
+    int32_t *d32 = dst;
+#pragma omp parallel num_threads(4)
+{
+    int id 	   = omp_get_thread_num();
+    int numthreads = omp_get_num_threads();
+    // Every thread converts one contiguous slice
+    long i, lo = n * id / numthreads, hi = n * (id + 1) / numthreads;
+    if (paired && channels == 3) {
+        uint8_t *r = (uint8_t *)planes[0] + first, *g = (uint8_t *)planes[1] + first, *b = (uint8_t *)planes[2] + first;
+        if (lo == 0 && hi > 0) {
+            d32[0] = r[0];
+            d32[1] = g[0];
+            d32[2] = b[0];
+        }
+#pragma omp simd
+        for (i = (lo > 0) ? lo : 1; i < hi; i++) {
+            d32[3 * i] = r[i] | r[i - 1] << 16;
+            d32[3 * i + 1] = g[i] | g[i - 1] << 16;
+            d32[3 * i + 2] = b[i] | b[i - 1] << 16;
+        }
+    }
+    else if (paired) {
+        uint8_t *p = (uint8_t *)planes[0] + first;
+        if (lo == 0 && hi > 0) d32[0] = p[0];
+#pragma omp simd
+        for (i = (lo > 0) ? lo : 1; i < hi; i++)
+            d32[i] = p[i] | p[i - 1] << 16;
+    }
+    else if (channels == 3) {
+        uint8_t *r = (uint8_t *)planes[0] + first, *g = (uint8_t *)planes[1] + first, *b = (uint8_t *)planes[2] + first;
+#pragma omp simd
+        for (i = lo; i < hi; i++) {
+            d16[3 * i] = r[i];
+            d16[3 * i + 1] = g[i];
+            d16[3 * i + 2] = b[i];
+        }
+    }
+    else {
+        uint8_t *p = (uint8_t *)planes[0] + first;
+#pragma omp simd
+        for (i = lo; i < hi; i++)
+            d16[i] = p[i];
+    }
+}//End parallel
+}
+
+// Store n pixels of (interleaved) ints into the planes of compact samples from pixel first, saturated to
+// [0, maxcolor]. Interleaved ints are saturated in place first, a contiguous sweep that vectorizes.
+void storeSamples(int* src, void** planes, int channels, int bytes, int maxcolor, long first, long n)
+{
+#pragma omp parallel num_threads(4)
+{
+    int id 	   = omp_get_thread_num();
+    int numthreads = omp_get_num_threads();
+    long i, lo = n * id / numthreads, hi = n * (id + 1) / numthreads;
+    if (channels == 3 && bytes == 1) {
+        uint8_t *r = (uint8_t *)planes[0] + first, *g = (uint8_t *)planes[1] + first, *b = (uint8_t *)planes[2] + first;
+#pragma omp simd
+        for (i = 3 * lo; i < 3 * hi; i++) src[i] = CLAMPSAMPLE(src[i], maxcolor);
+#pragma omp simd
+        for (i = lo; i < hi; i++) {
+            r[i] = (uint8_t)src[3 * i];
+            g[i] = (uint8_t)src[3 * i + 1];
+            b[i] = (uint8_t)src[3 * i + 2];
+        }
+    }
+    else if (channels == 3) {
+        uint16_t *r = (uint16_t *)planes[0] + first, *g = (uint16_t *)planes[1] + first, *b = (uint16_t *)planes[2] + first;
+#pragma omp simd
+        for (i = 3 * lo; i < 3 * hi; i++) src[i] = CLAMPSAMPLE(src[i], maxcolor);
+#pragma omp simd
+        for (i = lo; i < hi; i++) {
+            r[i] = (uint16_t)src[3 * i];
+            g[i] = (uint16_t)src[3 * i + 1];
+            b[i] = (uint16_t)src[3 * i + 2];
+        }
+    }
+    else if (bytes == 1) {
+        uint8_t *p = (uint8_t *)planes[0] + first;
+#pragma omp simd
+        for (i = lo; i < hi; i++)
+            p[i] = (uint8_t)CLAMPSAMPLE(src[i], maxcolor);
+    }
+    else {
+        uint16_t *p = (uint16_t *)planes[0] + first;
+#pragma omp simd
+        for (i = lo; i < hi; i++)
+            p[i] = (uint16_t)CLAMPSAMPLE(src[i], maxcolor);
+    }
+}//End parallel
+}
+
+// Run the kernel over a band of int samples: through the FFT when the cost model prefers it, as a horizontal and
+// a vertical 1D pass when it is separable, else with convolve2D.
+int convolveBand(int* in, int* out, int dataSizeX, int dataSizeY, kernelData kern)
+{
+    if (fftWorth(kern, dataSizeX, dataSizeY) && convolveFFT(in, out, dataSizeX, dataSizeY, kern) == 0)
+        return 0;
+    if (kern->separable)
+        return convolveSeparable(in, out, dataSizeX, dataSizeY, kern);
+    return convolve2D(in, out, dataSizeX, dataSizeY, 1, kern->vkern, kern->kernelX, kern->kernelY);
+}
+
+// Two-pass convolution with the factors of a separable kernel, kernel[m][n] = col[m]*row[n]. Samples outside
+// the plane count as zero, like in convolve2D, so partitions and halos give the same result; only the order
+// of the float additions changes. The horizontal pass keeps float sums in a plane sized buffer, the vertical
+// one adds whole rows of it into an accumulator row. Costs kernelX+kernelY multiply-adds per pixel.
+int convolveSeparable(int* in, int* out, int dataSizeX, int dataSizeY, kernelData kern)
+{
+    int kCenterX = kern->kernelX / 2, kCenterY = kern->kernelY / 2;
+    float *tmp;
+    int error = 0;
+
+    if(!in || !out) return -1;
+    if(dataSizeX <= 0 || dataSizeY <= 0) return 0;
+    if ((tmp = malloc((size_t)dataSizeX * dataSizeY * sizeof(float))) == NULL)
+        return convolve2D(in, out, dataSizeX, dataSizeY, 1, kern->vkern, kern->kernelX, kern->kernelY);
+#pragma omp parallel num_threads(4) reduction(|:error)
+{
+    int id 	   = omp_get_thread_num();
+    int numthreads = omp_get_num_threads();
+    int i, j, m, n, lo, hi;
+    float sum;
+    float *acc = malloc((size_t)dataSizeX * sizeof(float));
+    if (acc == NULL) error = 1;
+
+    // Horizontal pass, rows dealt round robin to the threads
+    for (i = id; i < dataSizeY; i += numthreads) {
+        int *inRow = in + (long)i * dataSizeX;
+        float *tRow = tmp + (long)i * dataSizeX;
+        for (j = 0; j < dataSizeX; j++) {
+            // Taps n with j+kCenterX-n inside the row
+            lo = j + kCenterX - (dataSizeX - 1);
+            if (lo < 0) lo = 0;
+            hi = j + kCenterX;
+            if (hi > kern->kernelX - 1) hi = kern->kernelX - 1;
+            sum = 0;
+            for (n = lo; n <= hi; n++) sum += inRow[j + kCenterX - n] * kern->row[n];
+            tRow[j] = sum;
+        }
+    }
+#pragma omp barrier
+    // Vertical pass, once every row of tmp is done
+    for (i = id; i < dataSizeY; i += numthreads) {
+        if (acc == NULL) continue;
+        int *outRow = out + (long)i * dataSizeX;
+        // Taps m with i+kCenterY-m inside the plane
+        lo = i + kCenterY - (dataSizeY - 1);
+        if (lo < 0) lo = 0;
+        hi = i + kCenterY;
+        if (hi > kern->kernelY - 1) hi = kern->kernelY - 1;
+        for (j = 0; j < dataSizeX; j++) acc[j] = 0;
+        for (m = lo; m <= hi; m++) {
+            float *tRow = tmp + (long)(i + kCenterY - m) * dataSizeX;
+            float w = kern->col[m];
+            for (j = 0; j < dataSizeX; j++) acc[j] += tRow[j] * w;
+        }
+        // convert integer number, rounding like convolve2D
+        for (j = 0; j < dataSizeX; j++)
+            outRow[j] = (acc[j] >= 0) ? (int)(acc[j] + 0.5f) : (int)(acc[j] - 0.5f);
+    }
+    free(acc);
+}//End parallel
+    free(tmp);
+    return error ? -1 : 0;
+}
+
+// FFT convolution by overlap-save blocks. Each tile of tileX x tileY output pixels reads an fftX x fftY window
+// (zero outside the plane) starting kernelX-1-kCenterX columns and kernelY-1-kCenterY rows before it, multiplies
+// its spectrum with the kernel's and keeps the part the circular wrap does not touch. The transforms are a few
+// times the kernel size, so memory stays bounded for any plane while a pixel costs O(log(fftX*fftY)) whatever
+// the kernel size. Half spectra are fftY rows of fftX/2+1 complex numbers (re,im), the layout of FFTW's r2c.
+// Built with -DHAVE_FFTW -lfftw3 FFTW does the transforms, else the radix-2 ones below.
+
+// Smallest power of two >= n (at least 2, rows are transformed in pairs).
+int fftLength(int n)
+{
+    int len = 2;
+    while (len < n) len <<= 1;
+    return len;
+}
+
+// Transform size of the tiles along a side: about four kernels (at least FFT_TILE), no more than the padded plane.
+int fftTileLength(int size, int ksize)
+{
+    int len = fftLength(4 * (ksize - 1));
+    if (len < FFT_TILE) len = FFT_TILE;
+    if (len > fftLength(size + ksize - 1)) len = fftLength(size + ksize - 1);
+    return len;
+}
+
+// Cost model: the direct taps per pixel (kernelX*kernelY, kernelX+kernelY when separable) against FFT_COST
+// operations per point and level of the tile transforms. CONV_FFT=1 always uses the FFT, CONV_FFT=0 never.
+int fftWorth(kernelData kern, int sizeX, int sizeY)
+{
+    char *env = getenv("CONV_FFT");
+    int kx = kern->kernelX, ky = kern->kernelY;
+    int fftX = fftTileLength(sizeX, kx), fftY = fftTileLength(sizeY, ky);
+    double tiles = (double)((sizeX + fftX - kx) / (fftX - kx + 1)) * ((sizeY + fftY - ky) / (fftY - ky + 1));
+    double taps = kern->separable ? kx + ky : (double)kx * ky;
+
+    if (env != NULL) return atoi(env) != 0;
+    return FFT_COST * tiles * fftX * fftY * log2((double)fftX * fftY) < taps * sizeX * sizeY;
+}
+
+// Buffers of the transforms (aligned for FFTW's SIMD codelets).
+double *fftAlloc(long n)
+{
+#ifdef HAVE_FFTW
+    return fftw_malloc(n * sizeof(double));
+#else
+    return malloc(n * sizeof(double));
+#endif
+}
+
+void fftRelease(double *p)
+{
+#ifdef HAVE_FFTW
+    if (p != NULL) fftw_free(p);
+#else
+    free(p);
+#endif
+}
+
+// Twiddle factors e^(-2*pi*i*k/n), k < n/2.
+double *fftTwiddles(int n)
+{
+    double *tw = malloc((size_t)n * sizeof(double));
+    int k;
+    if (tw == NULL) return NULL;
+    for (k = 0; k < n / 2; k++) {
+        tw[2*k] = cos(2 * M_PI * k / n);
+        tw[2*k+1] = -sin(2 * M_PI * k / n);
+    }
+    return tw;
+}
+
+// In place radix-2 transform of n complex numbers (unscaled when inverse).
+void fft1D(double *z, int n, double *tw, int inverse)
+{
+    int i, j, k, len, half, step, bit;
+    double t, tr, ti, wr, wi, *a, *b;
+
+    // bit reversed order
+    for (i = 1, j = 0; i < n; i++) {
+        for (bit = n >> 1; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) {
+            t = z[2*i]; z[2*i] = z[2*j]; z[2*j] = t;
+            t = z[2*i+1]; z[2*i+1] = z[2*j+1]; z[2*j+1] = t;
+        }
+    }
+    // butterflies
+    for (len = 2; len <= n; len <<= 1) {
+        half = len / 2;
+        step = n / len;
+        for (i = 0; i < n; i += len)
+            for (k = 0; k < half; k++) {
+                wr = tw[2*k*step];
+                wi = inverse ? -tw[2*k*step+1] : tw[2*k*step+1];
+                a = z + 2*(i+k);
+                b = a + 2*half;
+                tr = b[0] * wr - b[1] * wi;
+                ti = b[0] * wi + b[1] * wr;
+                b[0] = a[0] - tr; b[1] = a[1] - ti;
+                a[0] += tr; a[1] += ti;
+            }
+    }
+}
+
+// Tile geometry of a plane and its transforms (twiddles or FFTW plans), with the kernel spectrum in kern.
+int fftBlockInit(FFTBlock fb, kernelData kern, int sizeX, int sizeY)
+{
+    fb->fftX = fftTileLength(sizeX, kern->kernelX);
+    fb->fftY = fftTileLength(sizeY, kern->kernelY);
+    fb->tileX = fb->fftX - kern->kernelX + 1;
+    fb->tileY = fb->fftY - kern->kernelY + 1;
+#ifdef HAVE_FFTW
+    // Planned once; the threads run them on their own buffers (fftw_execute_dft_* is thread safe)
+    double *real = fftAlloc((long)fb->fftX * fb->fftY), *spec = fftAlloc((long)fb->fftY * (fb->fftX / 2 + 1) * 2);
+    fb->worklen = (long)fb->fftX * fb->fftY;
+    fb->forward = fb->inverse = NULL;
+    if (real != NULL && spec != NULL) {
+        fb->forward = fftw_plan_dft_r2c_2d(fb->fftY, fb->fftX, real, (fftw_complex *)spec, FFTW_ESTIMATE);
+        fb->inverse = fftw_plan_dft_c2r_2d(fb->fftY, fb->fftX, (fftw_complex *)spec, real, FFTW_ESTIMATE);
+    }
+    fftRelease(real);
+    fftRelease(spec);
+    if (fb->forward == NULL || fb->inverse == NULL) {
+        fftBlockFree(fb);
+        return -1;
+    }
+#else
+    fb->worklen = 2L * (fb->fftX > fb->fftY ? fb->fftX : fb->fftY);
+    fb->twX = fftTwiddles(fb->fftX);
+    fb->twY = fftTwiddles(fb->fftY);
+    if (fb->twX == NULL || fb->twY == NULL) {
+        fftBlockFree(fb);
+        return -1;
+    }
+#endif
+    if (kernelSpectrum(kern, fb)) {
+        fftBlockFree(fb);
+        return -1;
+    }
+    return 0;
+}
+
+void fftBlockFree(FFTBlock fb)
+{
+#ifdef HAVE_FFTW
+    if (fb->forward != NULL) fftw_destroy_plan(fb->forward);
+    if (fb->inverse != NULL) fftw_destroy_plan(fb->inverse);
+    fb->forward = fb->inverse = NULL;
+#else
+    free(fb->twX);
+    free(fb->twY);
+    fb->twX = fb->twY = NULL;
+#endif
+}
+
+#ifdef HAVE_FFTW
+// One tile: window at (x0,y0) minus the kernel offsets, product of the spectra, output pixels at (x0,y0).
+void fftTile(FFTBlock fb, double *spec, double *real, int *in, int *out, int sizeX, int sizeY, kernelData kern,
+             int x0, int y0)
+{
+    int wx = x0 - (kern->kernelX - 1 - kern->kernelX / 2), wy = y0 - (kern->kernelY - 1 - kern->kernelY / 2);
+    long i, n = (long)fb->fftY * (fb->fftX / 2 + 1);
+    int r, k;
+    double re, v;
+
+    memset(real, 0, (size_t)fb->fftX * fb->fftY * sizeof(double));
+    for (r = 0; r < fb->fftY; r++)
+        if (wy + r >= 0 && wy + r < sizeY)
+            for (k = (wx < 0) ? -wx : 0; k < fb->fftX && wx + k < sizeX; k++)
+                real[(long)r * fb->fftX + k] = in[(long)(wy + r) * sizeX + wx + k];
+    fftw_execute_dft_r2c(fb->forward, real, (fftw_complex *)spec);
+    for (i = 0; i < n; i++) {
+        re = spec[2*i] * kern->spec[2*i] - spec[2*i+1] * kern->spec[2*i+1];
+        spec[2*i+1] = spec[2*i] * kern->spec[2*i+1] + spec[2*i+1] * kern->spec[2*i];
+        spec[2*i] = re;
+    }
+    fftw_execute_dft_c2r(fb->inverse, (fftw_complex *)spec, real);
+    // convert integer number, rounding like convolve2D
+    for (r = 0; r < fb->tileY && y0 + r < sizeY; r++)
+        for (k = 0; k < fb->tileX && x0 + k < sizeX; k++) {
+            v = real[(long)(r + kern->kernelY - 1) * fb->fftX + k + kern->kernelX - 1];
+            out[(long)(y0 + r) * sizeX + x0 + k] = (v >= 0) ? (int)(v + 0.5) : (int)(v - 0.5);
+        }
+}
+
+#else
+// Forward transform of the rows of the fftX x fftY window at (x0,y0) of a plane (plane, or the kernel's floats in
+// kplane), zero outside it. z holds fftX complex numbers.
+void fftRows(FFTBlock fb, double *spec, double *z, int *plane, float *kplane, int sizeX, int sizeY, int x0, int y0)
+{
+    int fftX = fb->fftX;
+    long half = fftX / 2 + 1;
+    int r, k, nk, y, kmin = (x0 < 0) ? -x0 : 0, kmax = (sizeX - x0 < fftX) ? sizeX - x0 : fftX;
+    double zr, zi, cr, ci, *a, *b;
+
+    for (r = 0; r < fb->fftY; r += 2) {
+        a = spec + (long)r * half * 2;
+        b = a + half * 2;
+        y = y0 + r;
+        if (y >= sizeY || y + 1 < 0 || kmin >= kmax) {
+            memset(a, 0, half * 4 * sizeof(double));
+            continue;
+        }
+        // Two real rows in one complex transform: row r in the real part, row r+1 in the imaginary one
+        memset(z, 0, (size_t)fftX * 2 * sizeof(double));
+        for (k = kmin; k < kmax; k++) {
+            if (y >= 0) z[2*k] = plane ? plane[(long)y * sizeX + x0 + k] : kplane[(long)y * sizeX + x0 + k];
+            if (y + 1 < sizeY) z[2*k+1] = plane ? plane[(long)(y+1) * sizeX + x0 + k] : kplane[(long)(y+1) * sizeX + x0 + k];
+        }
+        fft1D(z, fftX, fb->twX, 0);
+        // Split them with the symmetry of real spectra, A[k] = (Z[k]+Z*[N-k])/2, B[k] = (Z[k]-Z*[N-k])/2i
+        for (k = 0; k < half; k++) {
+            nk = (fftX - k) & (fftX - 1);
+            zr = z[2*k]; zi = z[2*k+1]; cr = z[2*nk]; ci = -z[2*nk+1];
+            a[2*k] = (zr + cr) / 2; a[2*k+1] = (zi + ci) / 2;
+            b[2*k] = (zi - ci) / 2; b[2*k+1] = (cr - zr) / 2;
+        }
+    }
+}
+
+// Forward transform of the columns of a half spectrum. With a kernel spectrum, multiplies by it and transforms
+// back while the column is in cache. z holds fftY complex numbers.
+void fftColumns(FFTBlock fb, double *spec, double *kspec, double *z)
+{
+    int fftY = fb->fftY;
+    long half = fb->fftX / 2 + 1;
+    int r, k;
+    double re, kr, ki;
+
+    for (k = 0; k < half; k++) {
+        for (r = 0; r < fftY; r++) {
+            z[2*r] = spec[((long)r * half + k) * 2];
+            z[2*r+1] = spec[((long)r * half + k) * 2 + 1];
+        }
+        fft1D(z, fftY, fb->twY, 0);
+        if (kspec != NULL) {
+            for (r = 0; r < fftY; r++) {
+                kr = kspec[((long)r * half + k) * 2]; ki = kspec[((long)r * half + k) * 2 + 1];
+                re = z[2*r] * kr - z[2*r+1] * ki;
+                z[2*r+1] = z[2*r] * ki + z[2*r+1] * kr;
+                z[2*r] = re;
+            }
+            fft1D(z, fftY, fb->twY, 1);
+        }
+        for (r = 0; r < fftY; r++) {
+            spec[((long)r * half + k) * 2] = z[2*r];
+            spec[((long)r * half + k) * 2 + 1] = z[2*r+1];
+        }
+    }
+}
+
+// Inverse transform of the rows of a tile, storing its output pixels at (x0,y0) of out (clipped to the plane)
+// from the window position (offX,offY). z holds fftX complex numbers.
+void fftRowsInverse(FFTBlock fb, double *spec, double *z, int *out, int sizeX, int sizeY, int x0, int y0,
+                    int offX, int offY)
+{
+    int fftX = fb->fftX;
+    long half = fftX / 2 + 1;
+    int i, k, nk, pair;
+    double ar, ai, br, bi, v, *a, *b;
+    int *outRow;
+
+    for (i = 0; i < fb->tileY && y0 + i < sizeY; i += 2) {
+        a = spec + (long)(i + offY) * half * 2;
+        b = a + half * 2;
+        pair = (i + 1 < fb->tileY);
+        outRow = out + (long)(y0 + i) * sizeX + x0;
+        // Rows i+offY and i+offY+1 back in one transform, Z = A + iB rebuilt from the half spectra
+        for (k = 0; k < fftX; k++) {
+            nk = (k < half) ? k : fftX - k;
+            ar = a[2*nk]; ai = (k < half) ? a[2*nk+1] : -a[2*nk+1];
+            br = pair ? b[2*nk] : 0;
+            bi = pair ? ((k < half) ? b[2*nk+1] : -b[2*nk+1]) : 0;
+            z[2*k] = ar - bi;
+            z[2*k+1] = ai + br;
+        }
+        fft1D(z, fftX, fb->twX, 1);
+        // convert integer number, rounding like convolve2D
+        for (k = 0; k < fb->tileX && x0 + k < sizeX; k++) {
+            v = z[2*(k + offX)];
+            outRow[k] = (v >= 0) ? (int)(v + 0.5) : (int)(v - 0.5);
+            if (pair && y0 + i + 1 < sizeY) {
+                v = z[2*(k + offX) + 1];
+                outRow[sizeX + k] = (v >= 0) ? (int)(v + 0.5) : (int)(v - 0.5);
+            }
+        }
+    }
+}
+
+// One tile: window at (x0,y0) minus the kernel offsets, product of the spectra, output pixels at (x0,y0).
+void fftTile(FFTBlock fb, double *spec, double *z, int *in, int *out, int sizeX, int sizeY, kernelData kern,
+             int x0, int y0)
+{
+    int wx = x0 - (kern->kernelX - 1 - kern->kernelX / 2), wy = y0 - (kern->kernelY - 1 - kern->kernelY / 2);
+
+    fftRows(fb, spec, z, in, NULL, sizeX, sizeY, wx, wy);
+    fftColumns(fb, spec, kern->spec, z);
+    fftRowsInverse(fb, spec, z, out, sizeX, sizeY, x0, y0, kern->kernelX - 1, kern->kernelY - 1);
+}
+#endif
+
+// Kernel spectrum for the tile transforms, scaled by 1/(fftX*fftY) for the unscaled inverse. Kept in kern while
+// the size repeats (the three planes, equal partitions).
+int kernelSpectrum(kernelData kern, FFTBlock fb)
+{
+    long i, n = (long)fb->fftY * (fb->fftX / 2 + 1) * 2;
+    double *work;
+
+    if (kern->spec != NULL && kern->specX == fb->fftX && kern->specY == fb->fftY) return 0;
+    fftRelease(kern->spec);
+    kern->specX = kern->specY = 0;
+    if ((kern->spec = fftAlloc(n)) == NULL || (work = fftAlloc(fb->worklen)) == NULL) return -1;
+#ifdef HAVE_FFTW
+    int r, k;
+    memset(work, 0, (size_t)fb->worklen * sizeof(double));
+    for (r = 0; r < kern->kernelY; r++)
+        for (k = 0; k < kern->kernelX; k++)
+            work[(long)r * fb->fftX + k] = kern->vkern[r * kern->kernelX + k];
+    fftw_execute_dft_r2c(fb->forward, work, (fftw_complex *)kern->spec);
+#else
+    fftRows(fb, kern->spec, work, NULL, kern->vkern, kern->kernelX, kern->kernelY, 0, 0);
+    fftColumns(fb, kern->spec, NULL, work);
+#endif
+    fftRelease(work);
+    for (i = 0; i < n; i++) kern->spec[i] /= (double)fb->fftX * fb->fftY;
+    kern->specX = fb->fftX;
+    kern->specY = fb->fftY;
+    return 0;
+}
+
+// Convolution of a plane through the FFT, same output as convolve2D within one count. Returns -1, with out
+// undefined, when the buffers can not be allocated.
+int convolveFFT(int* in, int* out, int dataSizeX, int dataSizeY, kernelData kern)
+{
+    struct fftblock fb;
+    int tilesX, tilesY, error = 0;
+
+    if(!in || !out) return -1;
+    if(dataSizeX <= 0 || dataSizeY <= 0) return 0;
+    if (fftBlockInit(&fb, kern, dataSizeX, dataSizeY)) return -1;
+    tilesX = (dataSizeX + fb.tileX - 1) / fb.tileX;
+    tilesY = (dataSizeY + fb.tileY - 1) / fb.tileY;
+#pragma omp parallel num_threads(4) reduction(|:error)
+{
+    int id 	   = omp_get_thread_num();
+    int numthreads = omp_get_num_threads();
+    double *spec = fftAlloc((long)fb.fftY * (fb.fftX / 2 + 1) * 2), *work = fftAlloc(fb.worklen);
+    int t;
+    if (spec == NULL || work == NULL) error = 1;
+    // Tiles dealt round robin to the threads
+    for (t = id; t < tilesX * tilesY; t += numthreads) {
+        if (spec == NULL || work == NULL) continue;
+        fftTile(&fb, spec, work, in, out, dataSizeX, dataSizeY, kern, (t % tilesX) * fb.tileX, (t / tilesX) * fb.tileY);
+    }
+    fftRelease(spec);
+    fftRelease(work);
+}//End parallel
+    fftBlockFree(&fb);
+    return error ? -1 : 0;
+}
+
+
+// Rows of output produced by every band of the streaming mode. Large kernels get larger bands so
+// the halo rows convolved twice stay a small fraction of the work.
+int streamBandRows(kernelData kern){
+    return (2*kern->kernelY > STREAM_BANDROWS) ? 2*kern->kernelY : STREAM_BANDROWS;
+}
+
+// Streaming mode (no partitions argument). source and output hold a window of bufrows rows: a band of
+// output rows plus the kernel halo above and below. Every round reads the rows the window is missing,
+// convolves the window and stores the rows whose whole kernel support is in it. The last halo rows are
+// moved to the top of the window, so no row is read twice and memory does not depend on the image height.
+int streamImage(ImagenData source, ImagenData output, FILE *fpsrc, FILE *fpdst, kernelData kern, int bufrows,
+                long position, double *tread, double *tconv, double *tstore){
+    long ancho = source->ancho;
+    int kc = kern->kernelY/2;
+    int first = 0, loaded = 0, y = 0, last = 0, want = 0, drop = 0;
+    double start;
+    struct timeval tim;
+    struct imagenppm window;
+    while (y < source->altura) {
+        // Read the rows up to kc rows after the band
+        gettimeofday(&tim, NULL);
+        start = tim.tv_sec+(tim.tv_usec/1000000.0);
+        want = first + bufrows;
+        if (want > source->altura) want = source->altura;
+        if (want > first + loaded) {
+            window = *source;
+            window.R = SAMPLEAT(source->R, source->bytes, loaded*ancho);
+            if (source->channels == 3) {
+                window.G = SAMPLEAT(source->G, source->bytes, loaded*ancho);
+                window.B = SAMPLEAT(source->B, source->bytes, loaded*ancho);
+            }
+            if (readImage(&window, &fpsrc, (want - first - loaded)*ancho, 0, &position)) return -1;
+            source->carrylen = window.carrylen;
+            loaded = want - first;
+        }
+        gettimeofday(&tim, NULL);
+        *tread = *tread + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+
+        gettimeofday(&tim, NULL);
+        start = tim.tv_sec+(tim.tv_usec/1000000.0);
+        convolvePlanes((void *[]){source->R, source->G, source->B},
+                       (void *[]){output->R, output->G, output->B},
+                       source->channels, ancho, loaded, source->bytes, source->maxcolor, kern);
+        gettimeofday(&tim, NULL);
+        *tconv = *tconv + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+
+        // Rows near the bottom of the window are only complete at the end of the image
+        last = (first + loaded == source->altura) ? source->altura : first + loaded - kc;
+        gettimeofday(&tim, NULL);
+        start = tim.tv_sec+(tim.tv_usec/1000000.0);
+        if (savingChunk(output, &fpdst, (last - y)*ancho, (y - first)*ancho)) return -1;
+        gettimeofday(&tim, NULL);
+        *tstore = *tstore + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+        y = last;
+
+        // Keep the kc rows above the next output row
+        drop = y - kc - first;
+        if (drop > 0 && y < source->altura) {
+            memmove(source->R, SAMPLEAT(source->R, source->bytes, drop*ancho), (size_t)(loaded - drop)*ancho*source->bytes);
+            if (source->channels == 3) {
+                memmove(source->G, SAMPLEAT(source->G, source->bytes, drop*ancho), (size_t)(loaded - drop)*ancho*source->bytes);
+                memmove(source->B, SAMPLEAT(source->B, source->bytes, drop*ancho), (size_t)(loaded - drop)*ancho*source->bytes);
+            }
+            first += drop;
+            loaded -= drop;
+        }
+    }
+    return 0;
+}
+
+// Sizes of partition c: rows of halo read with it, pixels read and first pixel to store.
+void partitionLayout(int c, int partitions, long partsize, int ancho, int halo, int *halosize, long *chunksize, long *offset){
+    if (c==0) {
+        *halosize  = halo/2;
+        *offset    = 0;
+    }
+    else if(c<partitions-1) {
+        *halosize  = halo;
+        *offset    = (ancho*halo/2);
+    }
+    else {
+        *halosize  = halo/2;
+        *offset    = (ancho*halo/2);
+    }
+    *chunksize = partsize + ((long)ancho*(*halosize));
+}
+
+// Pipelined partition loop (CONV_PIPELINE=1). In every step one OpenMP section reads partition c+1, another
+// copies and convolves partition c and the last one stores partition c-1, so disk and CPU work overlap.
+// Source and output planes are double buffered. Each stage adds its busy time to its own timer.
+int pipelinePartitions(ImagenData source, ImagenData output, FILE *fpsrc, FILE *fpdst, kernelData kern, int partitions,
+                       int halo, long position, double *tread, double *tcopy, double *tconv, double *tstore){
+    ImagenData src[2], dst[2];
+    long partsize = ((long)source->altura*source->ancho)/partitions;
+    int step=0, error=0;
+    src[0] = source;
+    dst[0] = output;
+    if ((src[1] = duplicateImageData(source, partitions, halo)) == NULL) return -1;
+    if ((dst[1] = duplicateImageData(output, partitions, halo)) == NULL) return -1;
+    // The second buffers read and write through the same mapping and queues as the first ones
+    src[1]->map = source->map;
+    src[1]->mapsize = source->mapsize;
+    src[1]->uring = source->uring;
+    src[1]->tiles = source->tiles;
+    dst[1]->uring = output->uring;
+    dst[1]->tiles = output->tiles;
+    dst[1]->codec = output->codec;
+    // The stages start their own parallel regions (parser, convolve2D and writer)
+    omp_set_max_active_levels(2);
+    for (step = 0; step < partitions + 2 && !error; step++) {
+#pragma omp parallel sections num_threads(3) reduction(|:error)
+        {
+#pragma omp section
+            {
+                // Read partition step
+                int c = step, halosize;
+                long chunksize, offset;
+                double start;
+                struct timeval tim;
+                if (c < partitions) {
+                    gettimeofday(&tim, NULL);
+                    start = tim.tv_sec+(tim.tv_usec/1000000.0);
+                    partitionLayout(c, partitions, partsize, source->ancho, halo, &halosize, &chunksize, &offset);
+                    if (source->rowindex != NULL)
+                        position = pixelPosition(source, fpsrc, (long)c*partsize - (c > 0 ? source->ancho*halo/2 : 0));
+                    if (position < 0 || readImage(src[c%2], &fpsrc, chunksize, halo/2, &position)) error = 1;
+                    gettimeofday(&tim, NULL);
+                    *tread = *tread + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+                }
+            }
+#pragma omp section
+            {
+                // Copy and convolve partition step-1
+                int c = step-1, halosize;
+                long chunksize, offset;
+                double start;
+                struct timeval tim;
+                if (c >= 0 && c < partitions) {
+                    gettimeofday(&tim, NULL);
+                    start = tim.tv_sec+(tim.tv_usec/1000000.0);
+                    partitionLayout(c, partitions, partsize, source->ancho, halo, &halosize, &chunksize, &offset);
+                    if (duplicateImageChunk(src[c%2], dst[c%2], chunksize)) error = 1;
+                    gettimeofday(&tim, NULL);
+                    *tcopy = *tcopy + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+                    start = tim.tv_sec+(tim.tv_usec/1000000.0);
+                    convolvePlanes((void *[]){src[c%2]->R, src[c%2]->G, src[c%2]->B},
+                                   (void *[]){dst[c%2]->R, dst[c%2]->G, dst[c%2]->B},
+                                   source->channels, source->ancho, (source->altura/partitions)+halosize, source->bytes, source->maxcolor, kern);
+                    gettimeofday(&tim, NULL);
+                    *tconv = *tconv + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+                }
+            }
+#pragma omp section
+            {
+                // Store partition step-2
+                int c = step-2, halosize;
+                long chunksize, offset;
+                double start;
+                struct timeval tim;
+                if (c >= 0) {
+                    gettimeofday(&tim, NULL);
+                    start = tim.tv_sec+(tim.tv_usec/1000000.0);
+                    partitionLayout(c, partitions, partsize, source->ancho, halo, &halosize, &chunksize, &offset);
+                    if (savingChunk(dst[c%2], &fpdst, partsize, offset)) error = 1;
+                    gettimeofday(&tim, NULL);
+                    *tstore = *tstore + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+                }
+            }
+        }
+    }
+    src[1]->map = NULL;
+    src[1]->uring = NULL;
+    src[1]->tiles = NULL;
+    dst[1]->uring = NULL;
+    dst[1]->tiles = NULL;
+    dst[1]->codec = NULL;
+    freeImagestructure(&src[1]);
+    freeImagestructure(&dst[1]);
+    return error ? -1 : 0;
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////////////
 // MAIN FUNCTION
 //////////////////////////////////////////////////////////////////////////////////////////////////
@@ -333,23 +3164,36 @@ int main(int argc, char **argv)
     int i=0,j=0,k=0;
 //    int headstored=0, imagestored=0, stored;
     
-    if(argc != 5)
+    if(argc != 5 && argc != 4)
     {
-        printf("Usage: %s <image-file> <kernel-file> <result-file> <partitions>\n", argv[0]);
+        printf("Usage: %s <image-file> <kernel-file> <result-file> [<partitions>]\n", argv[0]);
         
         printf("\n\nError, Missing parameters:\n");
         printf("format: ./serialconvolution image_file kernel_file result_file\n");
-        printf("- image_file : source image path (*.ppm)\n");
-        printf("- kernel_file: kernel path (text file with 1D kernel matrix)\n");
-        printf("- result_file: result image path (*.ppm)\n");
-        printf("- partitions : Image partitions\n\n");
+        printf("- image_file : source image path (*.ppm or *.pgm, \"-\" reads stdin when streaming or with one partition)\n");
+        printf("- kernel_file: kernel path (text file with 1D kernel matrix, \"-\" copies the image)\n");
+        printf("- result_file: result image path (*.ppm or *.pgm, *.pct for a tiled image or \"-\" for stdout)\n");
+        printf("  Compressed images (*.gz, *.zst) are read and written when built with -DHAVE_ZLIB -lz or -DHAVE_ZSTD -lzstd\n");
+        printf("- partitions : Image partitions (without it the image is streamed in bands of rows)\n");
+        printf("Environment options:\n");
+        printf("- CONV_MMAP=1 : map the source image in memory instead of reading it with stdio\n");
+        printf("- CONV_INDEX=<rows> : keep an <image>.idx sidecar with the offset of every <rows>-th row\n");
+        printf("- CONV_TILE=<size>[,<pad>] : tile size and padding rows of *.pct results (default 256,0)\n");
+        printf("- CONV_URING=1 : read and write the images with io_uring, several blocks in flight\n");
+        printf("- CONV_SEPARABLE=0 : run separable kernels with the 2D convolution instead of two 1D passes\n");
+        printf("- CONV_FFT=0|1 : never or always convolve through the FFT (default: when the cost model says it is cheaper)\n");
+        printf("- CONV_SIMD=avx512|avx2|scalar : widest convolution kernels to use (default: the best the CPU has)\n");
+        printf("- CONV_UNROLL=0 : run 3x3, 5x5 and 7x7 kernels with the generic loops instead of the unrolled ones\n");
+        printf("- CONV_FIXED=1 : convolve 8-bit images with 16-bit fixed-point weights instead of floats (2D engine)\n");
+        printf("- CONV_PIPELINE=1 : overlap reading, convolution and storing of consecutive partitions\n\n");
         return -1;
     }
     
     //////////////////////////////////////////////////////////////////////////////////////////////////
     // READING IMAGE HEADERS, KERNEL Matrix, DUPLICATE IMAGE DATA, OPEN RESULTING IMAGE FILE
     //////////////////////////////////////////////////////////////////////////////////////////////////
-    int imagesize, partitions, partsize, chunksize, halo, halosize;
+    int partitions, halo, halosize;
+    long imagesize, partsize, chunksize;
     long position=0;
     double start, tstart=0, tend=0, tread=0, tcopy=0, tconv=0, tstore=0, treadk=0;
     struct timeval tim;
@@ -357,7 +3201,7 @@ int main(int argc, char **argv)
     ImagenData source=NULL, output=NULL;
 
     // Store number of partitions
-    partitions = atoi(argv[4]);
+    partitions = (argc == 5) ? atoi(argv[4]) : 0;
     ////////////////////////////////////////
     //Reading kernel matrix
     gettimeofday(&tim, NULL);
@@ -372,6 +3216,8 @@ int main(int argc, char **argv)
     //The matrix kernel define the halo size to use with the image. The halo is zero when the image is not partitioned.
     if (partitions==1) halo=0;
     else halo = (kern->kernelY/2)*2;
+    //Streaming reads a band of rows together with its halo.
+    if (partitions==0) halo = halo + streamBandRows(kern);
     gettimeofday(&tim, NULL);
     treadk = treadk + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
 
@@ -383,6 +3229,11 @@ int main(int argc, char **argv)
     if ( (source = initimage(argv[1], &fpsrc, partitions, halo)) == NULL) {
         return -1;
     }
+    //A pipe is read forward only: streaming keeps the halo rows in memory, partitions would go back for them
+    if (source->pipe && partitions > 1) {
+        fprintf(stderr, "Error: a piped or compressed image needs streaming (no partitions) or a single partition\n");
+        return -1;
+    }
     gettimeofday(&tim, NULL);
     tread = tread + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
     
@@ -407,14 +3258,31 @@ int main(int argc, char **argv)
     }
     gettimeofday(&tim, NULL);
     tstore = tstore + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);
+    //Pixels are read from the end of the source header.
+    position = source->datapos;
 
     //////////////////////////////////////////////////////////////////////////////////////////////////
     // CHUNK READING
     //////////////////////////////////////////////////////////////////////////////////////////////////
-    int c=0, offset=0;
-    imagesize = source->altura*source->ancho;
-    partsize  = (source->altura*source->ancho)/partitions;
+    int c=0;
+    long offset=0;
+    imagesize = (long)source->altura*source->ancho;
+    partsize  = (partitions > 0) ? imagesize/partitions : 0;
 //    printf("%s ocupa %dx%d=%d pixels. Partitions=%d, halo=%d, partsize=%d pixels\n", argv[1], source->altura, source->ancho, imagesize, partitions, halo, partsize);
+    //Streaming mode: a window of rows moves down the image.
+    if (partitions == 0 &&
+        streamImage(source, output, fpsrc, fpdst, kern, halo, position, &tread, &tconv, &tstore)) {
+        perror("Error: ");
+        return -1;
+    }
+    //Pipelined mode: reading, convolution and storing of consecutive partitions overlap.
+    if (partitions > 0 && getenv("CONV_PIPELINE") != NULL && atoi(getenv("CONV_PIPELINE"))) {
+        if (pipelinePartitions(source, output, fpsrc, fpdst, kern, partitions, halo, position, &tread, &tcopy, &tconv, &tstore)) {
+            perror("Error: ");
+            return -1;
+        }
+        c = partitions;
+    }
     // Puc fer for per particio?
     // Hotspot
     // parallel inhibitor
@@ -425,22 +3293,27 @@ int main(int argc, char **argv)
         start = tim.tv_sec+(tim.tv_usec/1000000.0);
         if (c==0) {
             halosize  = halo/2;
-            chunksize = partsize + (source->ancho*halosize);
+            chunksize = partsize + ((long)source->ancho*halosize);
             offset   = 0;
         }
         else if(c<partitions-1) {
             halosize  = halo;
-            chunksize = partsize + (source->ancho*halosize);
+            chunksize = partsize + ((long)source->ancho*halosize);
             offset    = (source->ancho*halo/2);
         }
         else {
             halosize  = halo/2;
-            chunksize = partsize + (source->ancho*halosize);
+            chunksize = partsize + ((long)source->ancho*halosize);
             offset    = (source->ancho*halo/2);
         }
         //DEBUG
 //        printf("\nRound = %d, position = %ld, partsize= %d, chunksize=%d pixels\n", c, position, partsize, chunksize);
         
+        //With a row index every partition is located on its own, from the first pixel it reads.
+        if (source->rowindex != NULL &&
+            (position = pixelPosition(source, fpsrc, (long)c*partsize - (c > 0 ? source->ancho*halo/2 : 0))) < 0) {
+            return -1;
+        }
         if (readImage(source, &fpsrc, chunksize, halo/2, &position)) {
             return -1;
         }
@@ -465,9 +3338,9 @@ int main(int argc, char **argv)
         gettimeofday(&tim, NULL);
         start = tim.tv_sec+(tim.tv_usec/1000000.0);
         
-        convolve2D(source->R, output->R, source->ancho, (source->altura/partitions)+halosize, kern->vkern, kern->kernelX, kern->kernelY);
-        convolve2D(source->G, output->G, source->ancho, (source->altura/partitions)+halosize, kern->vkern, kern->kernelX, kern->kernelY);
-        convolve2D(source->B, output->B, source->ancho, (source->altura/partitions)+halosize, kern->vkern, kern->kernelX, kern->kernelY);
+        convolvePlanes((void *[]){source->R, source->G, source->B},
+                       (void *[]){output->R, output->G, output->B},
+                       source->channels, source->ancho, (source->altura/partitions)+halosize, source->bytes, source->maxcolor, kern);
         
         gettimeofday(&tim, NULL);
         tconv = tconv + (tim.tv_sec+(tim.tv_usec/1000000.0) - start);